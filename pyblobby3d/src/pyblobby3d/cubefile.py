@@ -0,0 +1,140 @@
+"""Binary cube files.
+
+Read and write the binary cube format accepted by Blobby3D. A 128 byte
+little-endian header, carrying the same information as metadata.txt, is
+followed by the cube values in row-major (x, y, wavelength) order.
+
+Text inputs can be converted from the command line:
+
+    python -m pyblobby3d.cubefile metadata.txt data.txt data.b3d
+    python -m pyblobby3d.cubefile metadata.txt var.txt var.b3d
+
+@author: Mathew Varidel
+"""
+
+import argparse
+import struct
+from pathlib import Path
+import numpy as np
+
+
+MAGIC = b'B3DCUBE\x00'
+VERSION = 1
+HEADER = struct.Struct('<8sII3q6d40x')
+
+
+def is_binary(path):
+    """Whether path is a binary cube file."""
+    with open(Path(path), 'rb') as f:
+        return f.read(len(MAGIC)) == MAGIC
+
+
+def read_header(path):
+    """Read the header of a binary cube.
+
+    Parameters
+    ----------
+    path : str or pathlib.Path
+
+    Returns
+    -------
+    metadata : np.ndarray
+        Values in metadata.txt order, (ni, nj, nr, x_min, x_max, y_min,
+        y_max, r_min, r_max).
+    value_size : int
+        Bytes per value, 4 for float32 and 8 for float64.
+
+    """
+    with open(Path(path), 'rb') as f:
+        fields = HEADER.unpack(f.read(HEADER.size))
+
+    magic, version, value_size = fields[:3]
+    if magic != MAGIC:
+        raise ValueError('{} is not a binary cube'.format(path))
+    if version != VERSION:
+        raise ValueError('Unsupported binary cube version {}'.format(version))
+    if value_size not in (4, 8):
+        raise ValueError('Unsupported value size {}'.format(value_size))
+
+    return np.array(fields[3:], dtype=float), value_size
+
+
+def read_cube(path):
+    """Read a binary cube.
+
+    Parameters
+    ----------
+    path : str or pathlib.Path
+
+    Returns
+    -------
+    cube : np.ndarray
+        Memory mapped cube with shape (ni, nj, nr).
+    metadata : np.ndarray
+        Values in metadata.txt order.
+
+    """
+    metadata, value_size = read_header(path)
+    dtype = '<f4' if value_size == 4 else '<f8'
+    cube = np.memmap(
+        Path(path), dtype=dtype, mode='r', offset=HEADER.size,
+        shape=tuple(metadata[:3].astype(int)))
+
+    return cube, metadata
+
+
+def write_cube(path, cube, metadata, dtype='float64'):
+    """Write a binary cube.
+
+    Parameters
+    ----------
+    path : str or pathlib.Path
+    cube : np.ndarray
+        Cube with shape (ni, nj, nr).
+    metadata : array_like
+        Values in metadata.txt order. The shape must match the cube.
+    dtype : str, default is 'float64'
+        Either 'float32' or 'float64'.
+
+    Returns
+    -------
+    None.
+
+    """
+    dtype = np.dtype(dtype).newbyteorder('<')
+    if dtype.kind != 'f' or dtype.itemsize not in (4, 8):
+        raise ValueError('dtype must be float32 or float64')
+
+    metadata = np.asarray(metadata, dtype=float)
+    naxis = tuple(metadata[:3].astype(int))
+    cube = np.asarray(cube)
+    if cube.size != np.prod(naxis):
+        raise ValueError(
+            'Cube has {} values, metadata describes {}'.format(
+                cube.size, naxis))
+
+    header = HEADER.pack(
+        MAGIC, VERSION, dtype.itemsize, *naxis, *metadata[3:9])
+    with open(Path(path), 'wb') as f:
+        f.write(header)
+        f.write(np.ascontiguousarray(cube, dtype=dtype).tobytes())
+
+
+def convert(metadata_path, text_path, binary_path, dtype='float64'):
+    """Convert a text cube and its metadata to a binary cube."""
+    metadata = np.loadtxt(Path(metadata_path))
+    cube = np.loadtxt(Path(text_path)).reshape(metadata[:3].astype(int))
+    write_cube(binary_path, cube, metadata, dtype=dtype)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Convert a Blobby3D text cube to a binary cube.')
+    parser.add_argument('metadata', help='metadata file, e.g. metadata.txt')
+    parser.add_argument('input', help='text cube, e.g. data.txt')
+    parser.add_argument('output', help='binary cube, e.g. data.b3d')
+    parser.add_argument(
+        '--dtype', default='float64', choices=['float32', 'float64'])
+    args = parser.parse_args()
+
+    convert(args.metadata, args.input, args.output, dtype=args.dtype)
@@ -8,6 +8,8 @@ Organisation of the Blobby3D metadata that describes the coordinates.
 from pathlib import Path
 import numpy as np
 
+from .cubefile import is_binary, read_header
+
 
 class Metadata:
 
@@ -17,6 +19,8 @@ class Metadata:
         Parameters
         ----------
         metadata_path : str or pathlib.Path
+            Text metadata file, or a binary cube whose header holds the
+            metadata.
 
         Returns
         -------
@@ -39,7 +43,10 @@ class Metadata:
             Width of pixels along the wavelength axis.
 
         """
-        metadata = np.loadtxt(Path(metadata_path))
+        if is_binary(metadata_path):
+            metadata = read_header(metadata_path)[0]
+        else:
+            metadata = np.loadtxt(Path(metadata_path))
         self.naxis = metadata[:3].astype(int)
         self.sz = self.naxis.prod()
         self.x_lim = metadata[3:5]
@@ -16,6 +16,8 @@ import numpy as np
 import pandas as pd
 
 from .meta import Metadata
+from .cubefile import is_binary, read_cube
+from .samples import read_samples
 
 
 class PostBlobby3D:
@@ -23,7 +25,7 @@ class PostBlobby3D:
     def __init__(
             self, samples_path, data_path, var_path, metadata_path,
             save_maps=True, save_precon=True, save_con=True,
-            nlines=1, nsigmad=2):
+            nlines=1, nsigmad=2, products_path=None):
         """Blobby3D postprocess object.
 
         This provides a read and storage object for analysis.
@@ -34,14 +36,17 @@ class PostBlobby3D:
             Sample path. This can be either DNest4 samples or posterior
             samples.
         data_path : str or pathlib object
-            Data cube path. Data cubes are assumed to be in whitespace
-            separated text files. The values should be in row-major order.
+            Data cube path. Data cubes are either binary cube files or
+            whitespace separated text files. The values should be in
+            row-major order.
         var_path : str or pathlib object
-            Variance cube path. Variance cubes are assumed to be in whitespace
-            separated text files. The values should be in row-major order.
+            Variance cube path. Variance cubes are either binary cube files or
+            whitespace separated text files. The values should be in
+            row-major order.
         metadata_path : str or pathlib object
             Metadata file path. This path records the coordinates for your
-            cube.
+            cube. A binary data cube can be given, as its header holds the
+            metadata.
         save_maps : bool, optional
             Maps were saved to sampled by Blobby3D. The default is True.
         save_precon : bool, optional
@@ -58,6 +63,22 @@ class PostBlobby3D:
         nsigmad : int, optional
             The degree to which white and shot noise are modelled. The default
             is 2.
+        products_path : str or pathlib object, optional
+            Binary sample products file, written when SAMPLE_FORMAT is
+            FLOAT32 or FLOAT64, or by Blobby3DReplay. The maps and cubes are
+            then read from this file, which must hold one record per line of
+            samples_path. The save_maps, save_precon and save_con flags are
+            taken from its header. The default is None, where the products
+            are read from samples_path.
+
+            The file written by Blobby3D, once sampling is done, has one
+            record per line of the DNest4 sample.txt, so it does not line up
+            with posterior_sample.txt. For posterior products, run
+            Blobby3DReplay (or pyblobby3d.samples.replay) on
+            posterior_sample.txt and pass its output here, with
+            samples_path='posterior_sample.txt'. The replay is exact unless
+            SAMPLE_FORMAT is TEXT, which saves the parameters to 6 significant
+            figures, so it approximates the sampled products.
 
         Attributes
         ----------
@@ -91,19 +112,24 @@ class PostBlobby3D:
 
         # import data
         self.metadata = Metadata(self._metadata_path)
-        self.data = np.loadtxt(data_path).reshape(self.metadata.naxis)
-        self.var = np.loadtxt(var_path).reshape(self.metadata.naxis)
+        self.data = self._load_cube(data_path)
+        self.var = self._load_cube(var_path)
 
         # posterior samples
         samples = np.atleast_2d(np.loadtxt(samples_path))
         self.nsamples = samples.shape[0]
 
+        if products_path is not None:
+            # Maps and cubes are in the binary file, not the text samples
+            self._load_products(products_path)
+            save_maps = save_precon = save_con = False
+
+        map_shp = self.metadata.naxis[:2].prod()
         if save_maps:
             self.maps = np.zeros((
                     self.nsamples,
                     self._nlines+2,
                     *self.metadata.naxis[:2]))
-            map_shp = self.metadata.naxis[:2].prod()
             for s in range(self.nsamples):
                 # Flux
                 for ln in range(self._nlines):
@@ -183,6 +209,25 @@ class PostBlobby3D:
             self.blob_param.set_index(['SAMPLE', 'BLOB'], inplace=True)
             self.blob_param = self.blob_param[self.blob_param['RC'] > 0.0]
 
+    def _load_products(self, path):
+        """Load maps and cubes from a binary sample products file."""
+        products = read_samples(path)
+        for name, values in products.items():
+            if values.shape[0] != self.nsamples:
+                raise ValueError(
+                    '{} has {} samples, expected {}'.format(
+                        path, values.shape[0], self.nsamples))
+            setattr(self, name, values)
+
+    def _load_cube(self, path):
+        """Load a binary or text cube with the metadata shape."""
+        if is_binary(path):
+            cube = np.array(read_cube(path)[0], dtype=float)
+        else:
+            cube = np.loadtxt(path)
+
+        return cube.reshape(self.metadata.naxis)
+
     # def plot_global_marginalised(self, save_file=None):
     #     if isinstance(save_file, str):
     #         pdf_file = mpl.backends.backend_pdf.PdfPages(save_file)
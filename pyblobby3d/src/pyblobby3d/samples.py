@@ -0,0 +1,146 @@
+"""Binary sample products.
+
+Read the maps and cubes written by Blobby3D when SAMPLE_FORMAT is FLOAT32 or
+FLOAT64, or reconstructed from saved parameters by Blobby3DReplay. A 128 byte
+little-endian header describing the layout is followed by one fixed size
+record per sample.
+
+@author: Mathew Varidel
+"""
+
+import struct
+import subprocess
+from pathlib import Path
+import numpy as np
+
+
+MAGIC = b'B3DSMPL\x00'
+VERSION = 1
+HEADER = struct.Struct('<8sIIII2q3qq56x')
+
+SAVE_MAPS = 1
+SAVE_PRECONVOLVED = 2
+SAVE_CONVOLVED = 4
+
+
+def read_header(path):
+    """Read the header of a binary sample products file.
+
+    Parameters
+    ----------
+    path : str or pathlib.Path
+
+    Returns
+    -------
+    header : dict
+        Keys are value_size, products, nmaps, map_shape, cube_shape and
+        record_size.
+
+    """
+    with open(Path(path), 'rb') as f:
+        fields = HEADER.unpack(f.read(HEADER.size))
+
+    magic, version, value_size, products, nmaps = fields[:5]
+    if magic != MAGIC:
+        raise ValueError('{} is not a binary sample file'.format(path))
+    if version != VERSION:
+        raise ValueError('Unsupported sample file version {}'.format(version))
+    if value_size not in (4, 8):
+        raise ValueError('Unsupported value size {}'.format(value_size))
+
+    return {
+        'value_size': value_size,
+        'products': products,
+        'nmaps': nmaps,
+        'map_shape': tuple(fields[5:7]),
+        'cube_shape': tuple(fields[7:10]),
+        'record_size': fields[10],
+        }
+
+
+def read_samples(path):
+    """Read the products of each sample.
+
+    Parameters
+    ----------
+    path : str or pathlib.Path
+
+    Returns
+    -------
+    products : dict
+        Memory mapped arrays for the saved products. 'maps' has shape
+        (nsamples, nmaps, *map_shape), with the flux of each line followed by
+        the velocity and velocity dispersion maps. 'precon_cubes' and
+        'con_cubes' have shape (nsamples, *cube_shape).
+
+    """
+    header = read_header(path)
+    dtype = '<f4' if header['value_size'] == 4 else '<f8'
+    record_bytes = header['record_size']*header['value_size']
+    nsamples = (Path(path).stat().st_size - HEADER.size)//record_bytes
+
+    records = np.memmap(
+        Path(path), dtype=dtype, mode='r', offset=HEADER.size,
+        shape=(nsamples, header['record_size']))
+
+    products = {}
+    st = 0
+    if header['products'] & SAVE_MAPS:
+        shape = (header['nmaps'], *header['map_shape'])
+        end = st + int(np.prod(shape))
+        products['maps'] = records[:, st:end].reshape(nsamples, *shape)
+        st = end
+
+    cube_size = int(np.prod(header['cube_shape']))
+    if header['products'] & SAVE_PRECONVOLVED:
+        products['precon_cubes'] = records[:, st:st+cube_size].reshape(
+            nsamples, *header['cube_shape'])
+        st += cube_size
+
+    if header['products'] & SAVE_CONVOLVED:
+        products['con_cubes'] = records[:, st:st+cube_size].reshape(
+            nsamples, *header['cube_shape'])
+
+    return products
+
+
+def replay(
+        model_options, samples_path, output_path, samples=None,
+        products=None, threads=1, executable='Blobby3DReplay'):
+    """Reconstruct the products of saved samples with Blobby3DReplay.
+
+    Parameters
+    ----------
+    model_options : str or pathlib.Path
+        MODEL_OPTIONS file of the run. Data paths in it are relative to the
+        current directory.
+    samples_path : str or pathlib.Path
+        DNest4 samples, typically saved with SAMPLE_FORMAT PARAMETERS.
+    output_path : str or pathlib.Path
+        Binary sample products file to write.
+    samples : list of int, optional
+        Sample numbers to reconstruct, counting lines of samples_path from 0.
+        The default is None, which reconstructs all samples.
+    products : list of str, optional
+        Any of 'maps', 'preconvolved' and 'convolved'. The default is None,
+        which follows the SAVE_* options of model_options.
+    threads : int, default is 1
+        Samples reconstructed in parallel.
+    executable : str, default is 'Blobby3DReplay'
+
+    Returns
+    -------
+    products : dict
+        See read_samples.
+
+    """
+    cmd = [
+        executable, '-f', str(model_options), '-i', str(samples_path),
+        '-o', str(output_path), '-t', str(threads)]
+    if samples is not None:
+        cmd += ['-s', ','.join(str(s) for s in samples)]
+    if products is not None:
+        cmd += ['-p', ','.join(products)]
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+
+    return read_samples(output_path)
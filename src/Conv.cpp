@@ -2,58 +2,191 @@
 
 #include <iostream>
 #include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <chrono>
 
-#include "Data.h"
+#include "ThreadPool.h"
 
-// Conv Conv::instance;
+namespace {
+
+// View an interleaved (real, imaginary) array as fftw complex numbers
+inline fftw_complex* as_complex(double* v) {
+  return reinterpret_cast<fftw_complex*>(v);
+}
 
 /*
-  Public
+  One-sided Jacobi SVD of the row-major (m, n) matrix a, such that
+  a = sum_t s[t]*u[t]*v[t]^T with s in decreasing order. Only singular values
+  above the numerical rank tolerance are returned.
 */
-Conv::Conv(
-  int convolve,
-  std::vector<double> psf_amp,
-  std::vector<double> psf_fwhm,
-  double psf_beta,
-  std::vector<double> psf_sigma,
-  std::vector<double> psf_sigma_overdx,
-  std::vector<double> psf_sigma_overdy,
-  int ni,
-  int nj,
-  int nr,
-  double dx,
-  double dy,
-  double x_pad,
-  double y_pad
-  ) :convolve(convolve)
-    ,psf_amp(psf_amp)
-    ,psf_fwhm(psf_fwhm)
-    ,psf_beta(psf_beta)
-    ,psf_sigma(psf_sigma)
-    ,psf_sigma_overdx(psf_sigma_overdx)
-    ,psf_sigma_overdy(psf_sigma_overdy)
-    ,ni(ni)
-    ,nj(nj)
-    ,nr(nr)
-    ,dx(dx)
-    ,dy(dy)
-    ,x_pad(x_pad)
-    ,y_pad(y_pad)
-    ,sigma_cutoff(5.0) {
-
-  // Construct empty convolved matrix
-  convolved.resize(ni - 2*y_pad);
-  for (size_t i=0; i<convolved.size(); i++) {
-      convolved[i].resize(nj - 2*x_pad);
-      for (size_t j=0; j<convolved[i].size(); j++) {
-        convolved[i][j].resize(nr);
+void jacobi_svd(
+    std::vector<double> a, int m, int n,
+    std::vector<double>& s,
+    std::vector< std::vector<double> >& u,
+    std::vector< std::vector<double> >& v) {
+  std::vector<double> vt(n*n, 0.0);  // Columns of V, stored as rows
+  for (int q=0; q<n; q++)
+    vt[q*n + q] = 1.0;
+
+  // Rotate pairs of columns until all are orthogonal
+  bool rotated = true;
+  for (int sweep=0; rotated && (sweep<100); sweep++) {
+    rotated = false;
+    for (int p=0; p<n-1; p++) {
+      for (int q=p+1; q<n; q++) {
+        double alpha = 0.0, beta = 0.0, gamma = 0.0;
+        for (int i=0; i<m; i++) {
+          alpha += a[i*n + p]*a[i*n + p];
+          beta += a[i*n + q]*a[i*n + q];
+          gamma += a[i*n + p]*a[i*n + q];
+        }
+        if (std::abs(gamma) <= DBL_EPSILON*std::sqrt(alpha*beta))
+          continue;
+        rotated = true;
+
+        double zeta = (beta - alpha)/(2.0*gamma);
+        double t = ((zeta >= 0.0) ? 1.0 : -1.0)
+          /(std::abs(zeta) + std::sqrt(1.0 + zeta*zeta));
+        double c = 1.0/std::sqrt(1.0 + t*t);
+        double sn = c*t;
+        double ap, aq;
+        for (int i=0; i<m; i++) {
+          ap = a[i*n + p];
+          aq = a[i*n + q];
+          a[i*n + p] = c*ap - sn*aq;
+          a[i*n + q] = sn*ap + c*aq;
+        }
+        for (int i=0; i<n; i++) {
+          ap = vt[p*n + i];
+          aq = vt[q*n + i];
+          vt[p*n + i] = c*ap - sn*aq;
+          vt[q*n + i] = sn*ap + c*aq;
+        }
       }
+    }
   }
 
+  // Singular values are the column norms
+  std::vector<double> norm(n, 0.0);
+  std::vector<int> order(n);
+  for (int q=0; q<n; q++) {
+    for (int i=0; i<m; i++)
+      norm[q] += a[i*n + q]*a[i*n + q];
+    norm[q] = std::sqrt(norm[q]);
+    order[q] = q;
+  }
+  std::sort(
+    order.begin(), order.end(),
+    [&](int x, int y) { return norm[x] > norm[y]; });
+
+  const double tol = std::max(m, n)*DBL_EPSILON*norm[order[0]];
+  s.clear();
+  u.clear();
+  v.clear();
+  for (int h=0; h<n; h++) {
+    int q = order[h];
+    if (norm[q] <= tol)
+      break;
+
+    s.push_back(norm[q]);
+    u.push_back(std::vector<double>(m));
+    for (int i=0; i<m; i++)
+      u.back()[i] = a[i*n + q]/norm[q];
+    v.push_back(std::vector<double>(vt.begin() + q*n, vt.begin() + (q+1)*n));
+  }
+}
+
+}  // namespace
+
+/*
+  FftwPlans
+*/
+const char* FftwPlans::wisdom_filename = "fftw_wisdom.txt";
+bool FftwPlans::wisdom_loaded = false;
+bool FftwPlans::wisdom_saved = false;
+
+FftwPlans::FftwPlans(int Ni, int Nj, int batch) :batch(batch) {
+  /*
+    Plans are measured rather than estimated. Measuring overwrites the
+    arrays, so it uses its own aligned arrays matching ConvWorkspace,
+    as new-array execution requires the same alignment. Wisdom from earlier
+    runs is loaded so that measuring is quick when the cube shape is
+    unchanged.
+  */
+  const int n[2] = {Ni, Nj};
+  const int line = 64/sizeof(double);
+  real_dist = (Ni*Nj + line - 1)/line*line;
+  complex_dist = (Ni*(Nj/2+1) + line/2 - 1)/(line/2)*(line/2);
+  AlignedVector real(batch*real_dist, 0.0);
+  AlignedVector spectrum(2*batch*complex_dist, 0.0);
+
+  std::lock_guard<std::mutex> lock(planner_mutex());
+  if (!wisdom_loaded) {
+    fftw_import_wisdom_from_filename(wisdom_filename);
+    wisdom_loaded = true;
+  }
+
+  forward = fftw_plan_many_dft_r2c(
+    2, n, batch,
+    real.data(), NULL, 1, real_dist,
+    as_complex(spectrum.data()), NULL, 1, complex_dist,
+    FFTW_MEASURE);
+  backward = fftw_plan_many_dft_c2r(
+    2, n, batch,
+    as_complex(spectrum.data()), NULL, 1, complex_dist,
+    real.data(), NULL, 1, real_dist,
+    FFTW_MEASURE);
+
+  slice_forward = fftw_plan_dft_r2c_2d(
+    Ni, Nj, real.data(), as_complex(spectrum.data()), FFTW_MEASURE);
+  slice_backward = fftw_plan_dft_c2r_2d(
+    Ni, Nj, as_complex(spectrum.data()), real.data(), FFTW_MEASURE);
+
+  if (!wisdom_saved) {
+    fftw_export_wisdom_to_filename(wisdom_filename);
+    wisdom_saved = true;
+  }
+}
+
+FftwPlans::~FftwPlans() {
+  std::lock_guard<std::mutex> lock(planner_mutex());
+  fftw_destroy_plan(forward);
+  fftw_destroy_plan(backward);
+  fftw_destroy_plan(slice_forward);
+  fftw_destroy_plan(slice_backward);
+}
+
+std::mutex& FftwPlans::planner_mutex() {
+  static std::mutex mutex;
+  return mutex;
+}
+
+/*
+  Public
+*/
+PsfOperator::PsfOperator(const ModelContext& context)
+    :context(context)
+    ,convolve(context.get_convolve())
+    ,psf_amp(context.get_psf_amp())
+    ,psf_fwhm(context.get_psf_fwhm())
+    ,psf_beta(context.get_psf_beta())
+    ,psf_sigma(context.get_psf_sigma())
+    ,psf_sigma_overdx(context.get_psf_sigma_overdx())
+    ,psf_sigma_overdy(context.get_psf_sigma_overdy())
+    ,ni(context.get_ni())
+    ,nj(context.get_nj())
+    ,nr(context.get_nr())
+    ,dx(context.get_dx())
+    ,dy(context.get_dy())
+    ,x_pad(context.get_x_pad())
+    ,y_pad(context.get_y_pad())
+    ,sigma_cutoff(5.0) {
   /*
     Setup convolve method
   */
   double norm;
+  gaussian_method = 0;
   if (convolve == 0) {
     // Setup size of kernels due to number of gaussians
     kernel_x.resize(psf_sigma.size());
@@ -80,10 +213,38 @@ Conv::Conv(
       }
     }
 
-    // setup temporary convolved kernel for single separable convolution
-    convolved_tmp_2d.resize(ni);
-    for(size_t i=0; i<convolved_tmp_2d.size(); i++)
-      convolved_tmp_2d[i].resize(nj - 2*y_pad);
+    ni_tmp = ni;
+    nj_tmp = nj - 2*y_pad;
+
+    // Combine gaussians into a single 2D kernel
+    szk_2d_x = 0;
+    szk_2d_y = 0;
+    for (size_t k=0; k<psf_sigma.size(); k++) {
+      szk_2d_x = std::max(szk_2d_x, static_cast<int>(kernel_x[k].size()/2));
+      szk_2d_y = std::max(szk_2d_y, static_cast<int>(kernel_y[k].size()/2));
+    }
+    kernel_2d.assign((2*szk_2d_y + 1)*(2*szk_2d_x + 1), 0.0);
+    for (size_t k=0; k<psf_sigma.size(); k++) {
+      szk_x = kernel_x[k].size()/2;
+      szk_y = kernel_y[k].size()/2;
+      for (int i=-szk_y; i<=szk_y; i++)
+        for (int j=-szk_x; j<=szk_x; j++)
+          kernel_2d[(i + szk_2d_y)*(2*szk_2d_x + 1) + j + szk_2d_x] +=
+            psf_amp[k]*kernel_y[k][i+szk_y]*kernel_x[k][j+szk_x];
+    }
+
+    // Only valid spaxels are convolved
+    const std::vector<Spaxel>& valid = context.get_valid();
+    output_mask.assign((ni - 2*y_pad)*(nj - 2*x_pad), 0);
+    for (size_t h=0; h<valid.size(); h++)
+      output_mask[valid[h].i*(nj - 2*x_pad) + valid[h].j] = 1;
+
+    if (context.get_gaussian_method() == -2)
+      select_gaussian_method(false);
+    else if (context.get_gaussian_method() == -1)
+      select_gaussian_method(true);
+    else
+      set_gaussian_method(context.get_gaussian_method());
 
   } else if (convolve == 1) {
     /*
@@ -152,68 +313,272 @@ Conv::Conv(
     Ni = ni + nik - 1;
     Nj = nj + njk - 1;
 
-    // fftw arrays
-    in = new double[Ni*Nj];
-    in2 = new double[Ni*Nj];
-    double* kernelin = new double[Ni*Nj];
-
-    out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*Ni*(Nj/2+1));
-    kernelout = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*Ni*(Nj/2+1));
-    conv = (fftw_complex*) fftw_malloc(sizeof(fftw_complex)*Ni*(Nj/2+1));
-
-    p = fftw_plan_dft_r2c_2d(Ni, Nj, in, out, FFTW_ESTIMATE);
-    k = fftw_plan_dft_r2c_2d(Ni, Nj, kernelin, kernelout, FFTW_ESTIMATE);
-    q = fftw_plan_dft_c2r_2d(Ni, Nj, conv, in2, FFTW_ESTIMATE);
+    const int nc = Ni*(Nj/2+1);
+    const int batch = fft_batch;
+    plans = std::make_shared<FftwPlans>(Ni, Nj, std::min(batch, nr));
 
-    // Clear in arrays
-    for (int i=0; i<Ni*Nj; i++) {
-      in[i] = 0.0;
-      in2[i] = 0.0;
-      kernelin[i] = 0.0;
-    }
-
-    // Clear out arrays
-    for (int i=0; i<Ni*(Nj/2+1); i++) {
-      out[i][0] = 0.0; out[i][1] = 0.0;
-      kernelout[i][0] = 0.0; kernelout[i][1] = 0.0;
-      conv[i][0] = 0.0; conv[i][1] = 0.0;
-    }
-
-    // Zero pad kernel
-    for (int i=0; i<Ni*(Nj/2+1); i++)
-      kernelin[i] = 0.0;
-
-    // add temporary kernel up to the required size
+    // Zero pad kernel, adding temporary kernel up to the required size
+    AlignedVector kernelin(Ni*Nj, 0.0);
     for (int i=0; i<nik; i++) {
       for (int j=0; j<njk; j++) {
         kernelin[j + Nj*i] = kernel_tmp[(max_nik - nik)/2 + i][(max_njk - njk)/2 + j];
       }
     }
 
-    // transform moffat kernel
-    fftw_execute(k);
-    fftw_destroy_plan(k);
+    // transform moffat kernel once, shared by all slices
+    kernelout.assign(2*nc, 0.0);
+    {
+      std::lock_guard<std::mutex> lock(FftwPlans::planner_mutex());
+      fftw_plan k = fftw_plan_dft_r2c_2d(
+        Ni, Nj, kernelin.data(), as_complex(kernelout.data()),
+        FFTW_ESTIMATE);
+      fftw_execute(k);
+      fftw_destroy_plan(k);
+    }
+
+    // Kernel in spatial coordinates, reflected as applied by the transform
+    szk_2d_x = midjk;
+    szk_2d_y = midik;
+    kernel_2d.assign(nik*njk, 0.0);
+    for (int i=0; i<nik; i++)
+      for (int j=0; j<njk; j++)
+        kernel_2d[i*njk + j] = kernel_tmp[
+          (max_nik + nik)/2 - 1 - i][(max_njk + njk)/2 - 1 - j];
+
+    // All spaxels are convolved
+    output_mask.assign((ni - 2*y_pad)*(nj - 2*x_pad), 1);
+
+    // Forward and backward transform, plus the product of the spectra
+    full_cost = 5.0*Ni*Nj*log2(Ni*Nj) + 6.0*Ni*(Nj/2 + 1);
   }
 }
 
-std::vector< std::vector< std::vector<double> > > Conv::apply(
-    std::vector< std::vector< std::vector<double> > >& preconvolved) {
+std::shared_ptr<const PsfOperator> PsfOperator::get_instance() {
+  // Constructed once, when first used after the data is loaded
+  static const std::shared_ptr<const PsfOperator> instance =
+    std::make_shared<const PsfOperator>(ModelContext::get_instance());
+  return instance;
+}
+
+void PsfOperator::summarise() const {
+  if (convolve != 0)
+    return;
+
+  const char* method_names[] = {"separable", "low-rank", "direct"};
+  std::cout<<"Gaussian blur method: "<<method_names[gaussian_method];
+  if (context.get_gaussian_method() == -2)
+    std::cout<<" (fewest operations)";
+  else if (context.get_gaussian_method() == -1)
+    std::cout<<" (fastest measured)";
+  std::cout<<std::endl;
+}
+
+ConvWorkspace& PsfOperator::thread_workspace() {
+  // Sized by the first convolution on each thread, then reused
+  static thread_local ConvWorkspace workspace;
+  return workspace;
+}
+
+void PsfOperator::apply(
+    const Cube& preconvolved, Cube& convolved,
+    const std::vector<char>& active, ConvWorkspace& ws) const {
     /*
-      Calculate convolved cube given convolution method.
+      Calculate convolved cube given convolution method. Every value in the
+      output mask is rewritten, so shared values are not copied.
     */
-    if (convolve == 0)
-      return brute_gaussian_blur(preconvolved);
+    const CubeView out = convolved.discard();
+    prepare(ws);
+
+    if ((convolve == 0) && (gaussian_method == 2))
+      direct_gaussian_blur(preconvolved, out, active);
+    else if (convolve == 0)
+      brute_gaussian_blur(preconvolved, out, active, ws);
     else if (convolve == 1)
-      return fftw_moffat_blur(preconvolved);
+      fftw_moffat_blur(preconvolved, out, active, ws);
     else
       std::cerr<<"# ERROR: Undefined convolve procedure."<<std::endl;
 }
 
+void PsfOperator::apply_delta(
+    const std::vector<int>& spaxels, const std::vector<double>& delta,
+    Cube& convolved, std::vector<int>& touched, ConvWorkspace& ws) const {
+  /*
+    Scatter the change in each spaxel spectrum through the 2D kernel. The
+    preconvolved spaxel (a, b) contributes to convolved spaxel (i, j) with
+    weight kernel_2d(a - y_pad - i, b - x_pad - j).
+  */
+  const int ni_out = ni - 2*y_pad;
+  const int nj_out = nj - 2*x_pad;
+  const int nk_x = 2*szk_2d_x + 1;
+
+  // Columns outside the brute force blur do not contribute
+  const int nj_in = (convolve == 0) ? nj_tmp : nj;
+
+  std::vector<char>& touched_mask = ws.touched_mask;
+  if (touched_mask.size() != output_mask.size())
+    touched_mask.assign(output_mask.size(), 0);
+
+  const CubeView out = convolved.write();
+
+  int a, b;
+  int i, j;
+  int n_out;
+  double w;
+  for (size_t h=0; h<spaxels.size(); h++) {
+    a = spaxels[h]/nj;
+    b = spaxels[h]%nj;
+    if (b >= nj_in)
+      continue;
+
+    const double* delta_spec = &delta[h*nr];
+    for (int p=-szk_2d_y; p<=szk_2d_y; p++) {
+      i = a - y_pad - p;
+      if ((i < 0) || (i >= ni_out))
+        continue;
+
+      for (int q=-szk_2d_x; q<=szk_2d_x; q++) {
+        j = b - x_pad - q;
+        if ((j < 0) || (j >= nj_out))
+          continue;
+
+        n_out = i*nj_out + j;
+        w = kernel_2d[(p + szk_2d_y)*nk_x + q + szk_2d_x];
+        if (!output_mask[n_out] || (w == 0.0))
+          continue;
+
+        double* conv_spec = out.spectrum(i, j);
+        for (int r=0; r<nr; r++)
+          conv_spec[r] += w*delta_spec[r];
+
+        if (!touched_mask[n_out]) {
+          touched_mask[n_out] = 1;
+          touched.push_back(n_out);
+        }
+      }
+    }
+  }
+
+  // Reset workspace
+  for (size_t h=0; h<touched.size(); h++)
+    touched_mask[touched[h]] = 0;
+}
+
+bool PsfOperator::prefer_delta(size_t nspaxels) const {
+  return nspaxels*kernel_2d.size() < full_cost;
+}
+
 /*
   Private
 */
-std::vector< std::vector< std::vector<double> > > Conv::brute_gaussian_blur(
-    std::vector< std::vector< std::vector<double> > >& preconvolved) {
+void PsfOperator::prepare(ConvWorkspace& ws) const {
+  /*
+    Allocate zeroed workspace arrays on the first use by each thread. The
+    zero padding of the fftw input is never written, so it stays zero.
+  */
+  size_t n_tmp = 0, n_in = 0, n_out = 0;
+  if (convolve == 0) {
+    n_tmp = term_amp.size()*ni_tmp*nj_tmp*nr;
+  } else if (convolve == 1) {
+    n_in = plans->real_dist*nr;
+    n_out = 2*plans->complex_dist*nr;
+  }
+
+  if (ws.convolved_tmp.size() != n_tmp)
+    ws.convolved_tmp.assign(n_tmp, 0.0);
+  if (ws.in.size() != n_in)
+    ws.in.assign(n_in, 0.0);
+  if (ws.in2.size() != n_in)
+    ws.in2.assign(n_in, 0.0);
+  if (ws.out.size() != n_out)
+    ws.out.assign(n_out, 0.0);
+}
+
+void PsfOperator::set_gaussian_method(int method) {
+  /*
+    Setup the separable terms, workspace and cost for a Gaussian blur method.
+  */
+  const std::vector<Spaxel>& valid = context.get_valid();
+
+  gaussian_method = method;
+  if (method == 0) {
+    term_amp = psf_amp;
+    term_x = kernel_x;
+    term_y = kernel_y;
+  } else if (method == 1) {
+    jacobi_svd(
+      kernel_2d, 2*szk_2d_y + 1, 2*szk_2d_x + 1, term_amp, term_y, term_x);
+  } else {
+    term_amp.clear();
+    term_x.clear();
+    term_y.clear();
+  }
+
+  if (method == 2) {
+    // Blur valid spaxels by the full kernel
+    full_cost = valid.size()*kernel_2d.size();
+  } else {
+    // Blur across columns for all spaxels then rows for valid spaxels
+    full_cost = 0.0;
+    for (size_t k=0; k<term_amp.size(); k++) {
+      full_cost += ni_tmp*nj_tmp*term_x[k].size();
+      full_cost += valid.size()*term_y[k].size();
+    }
+  }
+}
+
+double PsfOperator::time_gaussian_method(int method) {
+  /*
+    Best of several timings of a blur of the full cube.
+  */
+  const int trials = 3;
+
+  set_gaussian_method(method);
+  Cube preconvolved(ni, nj, nr, 1.0);
+  Cube convolved(ni - 2*y_pad, nj - 2*x_pad, nr);
+  std::vector<char> active(nr, 1);
+  ConvWorkspace ws;
+
+  double best = 0.0;
+  for (int t=0; t<trials; t++) {
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    apply(preconvolved, convolved, active, ws);
+    double elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+    if ((t == 0) || (elapsed < best))
+      best = elapsed;
+  }
+
+  return best;
+}
+
+void PsfOperator::select_gaussian_method(bool timed) {
+  /*
+    Count the operations of each Gaussian blur method, or measure each one
+    if timed, and use the cheapest. Counting gives the same method on every
+    run; timings vary between runs and machines.
+  */
+  int selected = 0;
+  double cost, best = 0.0;
+  for (int method=0; method<=2; method++) {
+    if (timed) {
+      cost = time_gaussian_method(method);
+    } else {
+      set_gaussian_method(method);
+      cost = full_cost;
+    }
+    if ((method == 0) || (cost < best)) {
+      best = cost;
+      selected = method;
+    }
+  }
+
+  set_gaussian_method(selected);
+}
+
+void PsfOperator::brute_gaussian_blur(
+    const Cube& preconvolved, const CubeView& convolved,
+    const std::vector<char>& active, ConvWorkspace& ws) const {
   /*
     Calculate cube convolved by a decomposition of concentric Gaussians.
 
@@ -222,102 +587,254 @@ std::vector< std::vector< std::vector<double> > > Conv::brute_gaussian_blur(
     PSFs.
 
     It performs the multiple gaussian convolution by convolving by each
-    Gaussian kernel in turn. This uses the distributive property of
+    separable term in turn. This uses the distributive property of
     convolution.
 
-    This procedure is currently preferred for Moffat convolution compared to
-    the fftw_moffat_blur function whenever the code is executed in parallel.
-    Reasoning is due to the FFTW3 implementation not being thread-safe at this
-    time.
+    Spectra are contiguous, so whole spectra are convolved at once, in blocks
+    of wavelength bins small enough that the neighbouring spectra stay in
+    cache. Each pass handles all terms for a spaxel together, reading
+    the neighbouring spectra once.
   */
-  const std::vector< std::vector<int> >&
-    valid = Data::get_instance().get_valid();
-
-  int i, j;
-  int szk_x, szk_y;
-
-  // Clear convolved matrix
-  for (size_t h=0; h<valid.size(); h++) {
-    i = valid[h][0];
-    j = valid[h][1];
-    for (size_t r=0; r<convolved[i][j].size(); r++)
-      convolved[i][j][r] = 0.0;
-  }
-
-  // double norm;
-  for (int r=0; r<nr; r++) {
-    /*
-	    Convolve slice for each Gaussian kernel
-    */
-    for (size_t k=0; k<psf_sigma.size(); k++) {
-      szk_x = (int)std::ceil(sigma_cutoff*psf_sigma[k]/dx);
-      szk_y = (int)std::ceil(sigma_cutoff*psf_sigma[k]/dy);
-
-      // Blur across columns.
-      for (i=0; i<convolved_tmp_2d.size(); i++) {
-        for (j=0; j<convolved_tmp_2d[i].size(); j++) {
-	        convolved_tmp_2d[i][j] = 0.0;
-          for (int p=-szk_x; p<=szk_x; p++) {
-            if ((x_pad + j + p >= 0)
-                && (x_pad + j + p < convolved_tmp_2d[i].size())) {
-              convolved_tmp_2d[i][j] += preconvolved[i][x_pad+j+p][r]*kernel_x[k][szk_x+p];
-	          }
-	        }
-	      }
+  const std::vector<Spaxel>& valid = context.get_valid();
+
+  const size_t nk = term_amp.size();
+  ThreadPool& pool = ThreadPool::get_instance();
+
+  // Range of slices containing the active slices
+  int r_first = 0;
+  while ((r_first < nr) && !active[r_first])
+    r_first++;
+  int r_last = nr;
+  while ((r_last > r_first) && !active[r_last - 1])
+    r_last--;
+
+  // Blur across columns, sharing out rows.
+  pool.parallel_for(ni_tmp, 1, [&](int begin, int end) {
+    int nb, szk_x;
+    double w;
+    for (int r0=r_first; r0<r_last; r0+=spectral_block) {
+      nb = std::min(spectral_block, r_last - r0);
+      for (int i=begin; i<end; i++) {
+        for (int j=0; j<nj_tmp; j++) {
+          for (size_t k=0; k<nk; k++) {
+            szk_x = term_x[k].size()/2;
+            double* tmp = &ws.convolved_tmp[tmp_offset(k, i, j) + r0];
+            std::fill(tmp, tmp + nb, 0.0);
+            for (int p=-szk_x; p<=szk_x; p++) {
+              if ((x_pad + j + p >= 0)
+                  && (x_pad + j + p < nj_tmp)) {
+                w = term_x[k][szk_x+p];
+                const double* spectrum = preconvolved.spectrum(i, x_pad+j+p) + r0;
+                for (int r=0; r<nb; r++)
+                  tmp[r] += spectrum[r]*w;
+              }
+            }
+          }
+        }
       }
+    }
+  });
+
+  // Blur across rows for valid pixels, sharing out spaxels.
+  pool.parallel_for(valid.size(), spaxel_chunk, [&](int begin, int end) {
+    int i, j;
+    int nb, szk_y;
+    double w, amp;
+
+    // Clear convolved matrix
+    for (int h=begin; h<end; h++) {
+      i = valid[h].i;
+      j = valid[h].j;
+      std::fill(convolved.spectrum(i, j), convolved.spectrum(i, j) + nr, 0.0);
+    }
 
-      // Blur across rows for valid pixels.
-      for (size_t h=0; h<valid.size(); h++) {
-        i = valid[h][0];
-        j = valid[h][1];
-        for (int p=-szk_y; p<=szk_y; p++) {
-          if ((y_pad + i + p >= 0)
-              && (y_pad + i + p < convolved_tmp_2d.size())) {
-            convolved[i][j][r] += psf_amp[k]*convolved_tmp_2d[y_pad+i+p][j]*kernel_y[k][szk_y+p];
+    for (int r0=r_first; r0<r_last; r0+=spectral_block) {
+      nb = std::min(spectral_block, r_last - r0);
+      for (int h=begin; h<end; h++) {
+        i = valid[h].i;
+        j = valid[h].j;
+        double* conv_spec = convolved.spectrum(i, j) + r0;
+        for (size_t k=0; k<nk; k++) {
+          szk_y = term_y[k].size()/2;
+          amp = term_amp[k];
+          for (int p=-szk_y; p<=szk_y; p++) {
+            if ((y_pad + i + p >= 0)
+                && (y_pad + i + p < ni_tmp)) {
+              w = term_y[k][szk_y+p];
+              const double* tmp = &ws.convolved_tmp[tmp_offset(k, y_pad+i+p, j) + r0];
+              for (int r=0; r<nb; r++)
+                conv_spec[r] += amp*tmp[r]*w;
+            }
           }
         }
       }
     }
-  }
+  });
+}
+
+void PsfOperator::direct_gaussian_blur(
+    const Cube& preconvolved, const CubeView& convolved,
+    const std::vector<char>& active) const {
+  /*
+    Calculate cube convolved by the sum of concentric Gaussians, applying the
+    summed 2D kernel directly to the valid spaxels. Whole spectra are
+    convolved in blocks of wavelength bins, as in brute_gaussian_blur.
+  */
+  const std::vector<Spaxel>& valid = context.get_valid();
+
+  const int nk_x = 2*szk_2d_x + 1;
+
+  // Range of slices containing the active slices
+  int r_first = 0;
+  while ((r_first < nr) && !active[r_first])
+    r_first++;
+  int r_last = nr;
+  while ((r_last > r_first) && !active[r_last - 1])
+    r_last--;
+
+  // Output spaxels are independent, so they are shared out
+  ThreadPool::get_instance().parallel_for(
+    valid.size(), spaxel_chunk,
+    [&](int begin, int end) {
+      int i, j;
+      int row, col;
+      int nb;
+      double w;
+
+      // Clear convolved matrix
+      for (int h=begin; h<end; h++) {
+        i = valid[h].i;
+        j = valid[h].j;
+        std::fill(
+          convolved.spectrum(i, j), convolved.spectrum(i, j) + nr, 0.0);
+      }
 
-  return convolved;
+      for (int r0=r_first; r0<r_last; r0+=spectral_block) {
+        nb = std::min(spectral_block, r_last - r0);
+
+        for (int h=begin; h<end; h++) {
+          i = valid[h].i;
+          j = valid[h].j;
+          double* conv_spec = convolved.spectrum(i, j) + r0;
+          for (int p=-szk_2d_y; p<=szk_2d_y; p++) {
+            row = y_pad + i + p;
+            if ((row < 0) || (row >= ni_tmp))
+              continue;
+
+            for (int q=-szk_2d_x; q<=szk_2d_x; q++) {
+              col = x_pad + j + q;
+              if ((col < 0) || (col >= nj_tmp))
+                continue;
+
+              w = kernel_2d[(p + szk_2d_y)*nk_x + q + szk_2d_x];
+              const double* spectrum = preconvolved.spectrum(row, col) + r0;
+              for (int r=0; r<nb; r++)
+                conv_spec[r] += w*spectrum[r];
+            }
+          }
+        }
+      }
+    });
 }
 
-std::vector< std::vector< std::vector<double> > > Conv::fftw_moffat_blur(
-    std::vector< std::vector< std::vector<double> > >& preconvolved) {
+void PsfOperator::fftw_moffat_blur(
+    const Cube& preconvolved, const CubeView& convolved,
+    const std::vector<char>& active, ConvWorkspace& ws) const {
   /*
     Calculate cube convolved by a Moffat profile.
 
-    This method uses a non-thread safe implementation of FFTW3. As such, the
-    brute_gaussian_blur method is usually preferred.
+    The active wavelength slices are gathered from the spectra into
+    contiguous zero padded slices, one after another, and transformed in
+    batches of fft_batch slices, with batches shared out between threads.
+    Each thread works on its own run of slices, so no cache lines are
+    shared. The shared plans are executed on the caller's workspace, so
+    different models can convolve concurrently.
   */
-  for (int r=0; r<nr; r++) {
-    // put wavelength slice vector into fftw double
-    for (int i=0; i<ni; i++)
-      for (int j=0; j<nj; j++)
-        in[j + Nj*i] = preconvolved[i][j][r];
-
-    // transform slice
-    fftw_execute(p);
-
-    // convolve
-    for (int i=0; i<Ni*(Nj/2+1); i++) {
-      conv[i][0] = out[i][0]*kernelout[i][0] - out[i][1]*kernelout[i][1];
-      conv[i][1] = out[i][0]*kernelout[i][1] + out[i][1]*kernelout[i][0];
+  const double* kernel = kernelout.data();
+  const int nc = Ni*(Nj/2+1);
+  const int real_dist = plans->real_dist;
+  const int complex_dist = plans->complex_dist;
+  const int batch = plans->batch;
+  ThreadPool& pool = ThreadPool::get_instance();
+
+  std::vector<int> slices;
+  for (int r=0; r<nr; r++)
+    if (active[r])
+      slices.push_back(r);
+  const int nslices = slices.size();
+
+  // put active slices into the zero padded fftw array
+  pool.parallel_for(ni, 1, [&](int begin, int end) {
+    for (int i=begin; i<end; i++) {
+      const double* spectra = preconvolved.spectrum(i, 0);
+      for (int s=0; s<nslices; s++) {
+        double* row = &ws.in[s*real_dist + Nj*i];
+        const double* values = spectra + slices[s];
+        for (int j=0; j<nj; j++)
+          row[j] = values[j*nr];
+      }
     }
+  });
+
+  pool.parallel_for((nslices + batch - 1)/batch, 1, [&](int begin, int end) {
+    double re, im;
+    for (int b=begin; b<end; b++) {
+      const int first = b*batch;
+      const int last = std::min(first + batch, nslices);
+
+      // transform slices, a full batch at once
+      if (last - first == batch) {
+        fftw_execute_dft_r2c(
+          plans->forward, ws.in.data() + first*real_dist,
+          as_complex(ws.out.data() + 2*first*complex_dist));
+      } else {
+        for (int s=first; s<last; s++)
+          fftw_execute_dft_r2c(
+            plans->slice_forward, ws.in.data() + s*real_dist,
+            as_complex(ws.out.data() + 2*s*complex_dist));
+      }
 
-    // backwards transform to slice
-    fftw_execute(q);
+      // convolve
+      for (int s=first; s<last; s++) {
+        double* values = &ws.out[2*s*complex_dist];
+        for (int n=0; n<nc; n++) {
+          re = values[2*n];
+          im = values[2*n+1];
+          values[2*n] = re*kernel[2*n] - im*kernel[2*n+1];
+          values[2*n+1] = re*kernel[2*n+1] + im*kernel[2*n];
+        }
+      }
 
-    // put renormalised convolved slice in convolved matrix
-    const double invnorm = 1.0/(Ni*Nj);
-    for (int i=0; i<ni-2*y_pad; i++) {
-      for (int j=0; j<nj-2*x_pad; j++) {
-        convolved[i][j][r] = in2[midjk + x_pad + j + Nj*(i + midik + y_pad)];
-	      convolved[i][j][r] *= invnorm;
+      // backwards transform to slices
+      if (last - first == batch) {
+        fftw_execute_dft_c2r(
+          plans->backward, as_complex(ws.out.data() + 2*first*complex_dist),
+          ws.in2.data() + first*real_dist);
+      } else {
+        for (int s=first; s<last; s++)
+          fftw_execute_dft_c2r(
+            plans->slice_backward,
+            as_complex(ws.out.data() + 2*s*complex_dist),
+            ws.in2.data() + s*real_dist);
       }
     }
-  }
-
-  return convolved;
+  });
+
+  // put renormalised convolved slices in convolved matrix, with inactive
+  // slices set to zero
+  const double invnorm = 1.0/(Ni*Nj);
+  const int nj_out = nj - 2*x_pad;
+  pool.parallel_for(ni - 2*y_pad, 1, [&](int begin, int end) {
+    for (int i=begin; i<end; i++) {
+      double* spectra = convolved.spectrum(i, 0);
+      std::fill(spectra, spectra + nj_out*nr, 0.0);
+      for (int s=0; s<nslices; s++) {
+        const double* row =
+          &ws.in2[s*real_dist + Nj*(i + midik + y_pad) + midjk + x_pad];
+        double* values = spectra + slices[s];
+        for (int j=0; j<nj_out; j++)
+          values[j*nr] = row[j]*invnorm;
+      }
+    }
+  });
 }
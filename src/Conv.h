@@ -2,13 +2,85 @@
 #define BLOBBY3D_CONV_H_
 
 #include <vector>
+#include <memory>
+#include <mutex>
 #include <fftw3.h>
 
+#include "Cube.h"
+#include "ModelContext.h"
+
 /*
-  Class for convolving by the PSF
+  Forward and backward FFTW plans transforming a batch of (Ni, Nj) real
+  slices stored one after another, and a single one of those slices. Each
+  slice starts real_dist doubles (complex_dist complex values) after the
+  previous one, rounded up to a cache line, so every slice is aligned like
+  the arrays the plans were made for and any run of slices can be
+  transformed. The FFTW planner is not thread-safe, so plans are created
+  and destroyed while holding a global lock. Executing a plan on new arrays
+  is thread-safe, so one set of plans is shared by all models.
 */
-class Conv {
+class FftwPlans {
+ private:
+  FftwPlans(const FftwPlans& other);
+  FftwPlans& operator=(const FftwPlans& other);
+
+  // Wisdom is loaded once, and saved once after the first plans are made
+  static const char* wisdom_filename;
+  static bool wisdom_loaded;
+  static bool wisdom_saved;
+
+ public:
+  int batch;
+  int real_dist, complex_dist;
+  fftw_plan forward, backward;
+  fftw_plan slice_forward, slice_backward;
+
+  FftwPlans(int Ni, int Nj, int batch);
+  ~FftwPlans();
+
+  // Lock to hold while calling any FFTW function other than fftw_execute*
+  static std::mutex& planner_mutex();
+};
+
+/*
+  Scratch arrays for convolving. The contents are only used within a
+  convolution, so each thread keeps one workspace (see
+  PsfOperator::thread_workspace) and reuses it for every model it convolves.
+  Arrays are sized when first used.
+*/
+struct ConvWorkspace {
  private:
+  ConvWorkspace(const ConvWorkspace& other);
+  ConvWorkspace& operator=(const ConvWorkspace& other);
+
+ public:
+  ConvWorkspace() {}
+
+  // Cubes blurred across columns, one per separable term
+  AlignedVector convolved_tmp;
+
+  // fftw arrays with room for all nr slices, laid out as for FftwPlans,
+  // with complex values stored as (real, imaginary) pairs. The product of
+  // the spectra is formed in place in out.
+  AlignedVector in, in2;
+  AlignedVector out;
+
+  // Output spaxels changed by apply_delta
+  std::vector<char> touched_mask;
+};
+
+/*
+  Convolution by the PSF. The kernels, transformed kernel and fftw plans are
+  immutable once constructed, so a single operator is shared by all models
+  and threads, with each thread supplying its own workspace.
+*/
+class PsfOperator {
+ private:
+  PsfOperator(const PsfOperator& other);
+  PsfOperator& operator=(const PsfOperator& other);
+
+  const ModelContext& context;
+
   // convolve method
   int convolve;
 
@@ -26,58 +98,152 @@ class Conv {
   // vectors for separable kernel
   std::vector< std::vector<double> > kernel_x;
   std::vector< std::vector<double> > kernel_y;
-  std::vector< std::vector<double> > convolved_tmp_2d;
 
-  // vector for moffat kernel
-  std::vector< std::vector<double> > kernel;
+  /*
+    Separable terms term_amp[t]*(term_y[t] x term_x[t]) summing to the PSF,
+    either one per Gaussian or from a low-rank decomposition of kernel_2d.
+  */
+  std::vector<double> term_amp;
+  std::vector< std::vector<double> > term_x;
+  std::vector< std::vector<double> > term_y;
+
+  // Shape (ni_tmp, nj_tmp, nr) of each cube blurred across columns
+  int ni_tmp, nj_tmp;
+
+  /*
+    Gaussian blur method: 0 = separable pass per Gaussian, 1 = separable
+    passes from a low-rank decomposition of the summed kernel, 2 = direct 2D
+    convolution by the summed kernel. The method is given by
+    GAUSSIAN_METHOD, or else chosen when the operator is constructed.
+  */
+  int gaussian_method;
+
+  void set_gaussian_method(int method);
+  double time_gaussian_method(int method);
+  // Use the method with the fewest operations, or the fastest if timed
+  void select_gaussian_method(bool timed);
 
-  // fftw pointers/plans
-  fftw_complex *out, *kernelout, *conv;
-  fftw_plan p, q, k;
-  double* in;
-  double* in2;
+  // Full 2D kernel, shape (2*szk_2d_y+1, 2*szk_2d_x+1), used to convolve
+  // individual spaxels
+  std::vector<double> kernel_2d;
+  int szk_2d_x, szk_2d_y;
+
+  // Output spaxels computed by the convolution method
+  std::vector<char> output_mask;
+
+  // Approximate number of operations per wavelength slice for apply
+  double full_cost;
+
+  // fftw plans and transformed kernel
+  std::shared_ptr<FftwPlans> plans;
+  AlignedVector kernelout;
   int Ni, Nj;
   int nik, njk;
   int midik, midjk;
 
-  // Convolved matrix
-  std::vector< std::vector< std::vector<double> > > convolved;
-
   /*
     Convolution Methods
   */
-  // brute force gaussian blur
-  std::vector< std::vector< std::vector<double> > > brute_gaussian_blur(
-      std::vector< std::vector< std::vector<double> > >& preconvolved);
+  // Number of wavelength bins convolved at a time by brute_gaussian_blur
+  static const int spectral_block = 64;
+
+  // Number of wavelength slices transformed at a time by fftw_moffat_blur
+  static const int fft_batch = 8;
+
+  // Number of spaxels per chunk of work shared between threads
+  static const int spaxel_chunk = 16;
+
+  // Offset of spectrum (i, j) of term k in convolved_tmp
+  size_t tmp_offset(size_t k, size_t i, size_t j) const
+  { return ((k*ni_tmp + i)*nj_tmp + j)*nr; }
+
+  // Size the workspace arrays used by the convolution method
+  void prepare(ConvWorkspace& ws) const;
+
+  // brute force gaussian blur by separable terms
+  void brute_gaussian_blur(
+    const Cube& preconvolved, const CubeView& convolved,
+    const std::vector<char>& active, ConvWorkspace& ws) const;
+
+  // gaussian blur by the summed 2D kernel
+  void direct_gaussian_blur(
+    const Cube& preconvolved, const CubeView& convolved,
+    const std::vector<char>& active) const;
 
   // fftw moffat blur
-  std::vector< std::vector< std::vector<double> > > fftw_moffat_blur(
-      std::vector< std::vector< std::vector<double> > >& preconvolved);
+  void fftw_moffat_blur(
+    const Cube& preconvolved, const CubeView& convolved,
+    const std::vector<char>& active, ConvWorkspace& ws) const;
+
+ public:
+  explicit PsfOperator(const ModelContext& context);
 
-  // Constructor
-  // static Conv instance;
+  /*
+    Apply convolution by the method of the model context. The
+    result is written into the caller-owned convolved cube, which must have
+    shape (ni - 2*y_pad, nj - 2*x_pad, nr). Only wavelength slices flagged in
+    active are convolved; the other slices of preconvolved must be zero and
+    are set to zero in convolved. Spaxels outside the output mask must be
+    zero and are left as they are. Storage shared with copies of convolved
+    is replaced by fresh storage rather than copied.
+  */
+  void apply(
+    const Cube& preconvolved, Cube& convolved,
+    const std::vector<char>& active, ConvWorkspace& ws) const;
+
+  /*
+    Update the convolved cube for changes to a subset of preconvolved
+    spectra. spaxels lists the changed spaxels (flattened i*nj + j) and delta
+    holds the change in their spectra, one spectrum per spaxel. As the
+    convolution is linear, the convolved change is added to convolved. The
+    output spaxels (flattened over the convolved cube) that were changed are
+    appended to touched.
+  */
+  void apply_delta(
+    const std::vector<int>& spaxels, const std::vector<double>& delta,
+    Cube& convolved, std::vector<int>& touched, ConvWorkspace& ws) const;
+
+  // Determine if apply_delta is cheaper than apply for nspaxels changes
+  bool prefer_delta(size_t nspaxels) const;
+
+  // Gaussian blur method in use
+  int get_gaussian_method() const { return gaussian_method; }
+
+  // Print the convolution method in use to the terminal
+  void summarise() const;
+
+  // Operator for the PSF of the model context, constructed on first use
+  static std::shared_ptr<const PsfOperator> get_instance();
+
+  // Workspace of the calling thread, kept for the life of the thread
+  static ConvWorkspace& thread_workspace();
+};
+
+/*
+  Class for convolving by the PSF, pairing the shared PsfOperator with the
+  workspace of the calling thread. Copying a model copies only the pointer.
+*/
+class Conv {
+ private:
+  std::shared_ptr<const PsfOperator> psf;
 
  public:
-  Conv(
-    int convolve,
-    std::vector<double> psf_amp,
-    std::vector<double> psf_fwhm,
-    double psf_beta,
-    std::vector<double> psf_sigma,
-    std::vector<double> psf_sigma_overdx,
-    std::vector<double> psf_sigma_overdy,
-    int ni,
-    int nj,
-    int nr,
-    double dx,
-    double dy,
-    double x_pad,
-    double y_pad
-    );
-
-  // Apply convolution by implied method passed to class constructor.
-  std::vector< std::vector< std::vector<double> > > apply(
-      std::vector< std::vector< std::vector<double> > >& preconvolved);
+  Conv() :psf(PsfOperator::get_instance()) {}
+
+  void apply(
+    const Cube& preconvolved, Cube& convolved,
+    const std::vector<char>& active)
+  { psf->apply(preconvolved, convolved, active,
+               PsfOperator::thread_workspace()); }
+
+  void apply_delta(
+    const std::vector<int>& spaxels, const std::vector<double>& delta,
+    Cube& convolved, std::vector<int>& touched)
+  { psf->apply_delta(spaxels, delta, convolved, touched,
+                     PsfOperator::thread_workspace()); }
+
+  bool prefer_delta(size_t nspaxels) const
+  { return psf->prefer_delta(nspaxels); }
 };
 
 #endif  // BLOBBY3D_CONV_H_
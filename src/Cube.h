@@ -0,0 +1,271 @@
+#ifndef BLOBBY3D_CUBE_H_
+#define BLOBBY3D_CUBE_H_
+
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+/*
+  Allocator returning storage aligned to a cache line, so that the start of
+  every array (and of every spectrum when nr is a multiple of 8) is suitable
+  for aligned vector loads.
+*/
+template <typename T, size_t Alignment = 64>
+class AlignedAllocator {
+ public:
+  typedef T value_type;
+
+  template <typename U>
+  struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+  AlignedAllocator() {}
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+  T* allocate(size_t n) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, Alignment, n*sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, size_t) { free(ptr); }
+};
+
+template <typename T, typename U, size_t Alignment>
+bool operator==(
+    const AlignedAllocator<T, Alignment>&,
+    const AlignedAllocator<U, Alignment>&) { return true; }
+
+template <typename T, typename U, size_t Alignment>
+bool operator!=(
+    const AlignedAllocator<T, Alignment>&,
+    const AlignedAllocator<U, Alignment>&) { return false; }
+
+typedef std::vector<double, AlignedAllocator<double> > AlignedVector;
+
+/*
+  Array shared between copies until one of them writes to it, when the
+  writer takes its own copy. Copying is then O(1), and only arrays that are
+  modified are duplicated.
+
+  The reference count is atomic, and a holder that finds itself the only
+  reference (acquire) also sees every access made through references
+  already released (acq_rel), so copies may be released from any thread.
+  Copying an array, like writing it, must not race with other accesses to
+  that same object. write() or discard() must be called once before an
+  array is written from several threads, so that the threads find it
+  already unique.
+*/
+template <typename Vector>
+class SharedArray {
+ public:
+  typedef typename Vector::value_type value_type;
+
+ private:
+  struct Block {
+    std::atomic<long> refs;
+    Vector values;
+
+    Block() :refs(1) {}
+    Block(size_t n, value_type value) :refs(1), values(n, value) {}
+    explicit Block(const Vector& other) :refs(1), values(other) {}
+  };
+
+  Block* block;
+
+  void release() {
+    if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      delete block;
+  }
+
+  void replace(Block* fresh) {
+    release();
+    block = fresh;
+  }
+
+ public:
+  SharedArray() :block(new Block()) {}
+  SharedArray(size_t n, value_type value) :block(new Block(n, value)) {}
+  SharedArray(const SharedArray& other) :block(other.block) {
+    block->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+  SharedArray& operator=(const SharedArray& other) {
+    other.block->refs.fetch_add(1, std::memory_order_relaxed);
+    replace(other.block);
+    return *this;
+  }
+  ~SharedArray() { release(); }
+
+  bool unique() const
+  { return block->refs.load(std::memory_order_acquire) == 1; }
+
+  // Replace contents without copying the old ones
+  void assign(size_t n, value_type value) {
+    if (unique())
+      block->values.assign(n, value);
+    else
+      replace(new Block(n, value));
+  }
+
+  const Vector& read() const { return block->values; }
+
+  // Unique storage holding the current values
+  Vector& write() {
+    if (!unique())
+      replace(new Block(block->values));
+    return block->values;
+  }
+
+  /*
+    Unique storage of the same size whose values are about to be
+    overwritten. Shared values are not copied: fresh storage is zeroed, and
+    storage already unique keeps its old values.
+  */
+  Vector& discard() {
+    if (!unique())
+      replace(new Block(block->values.size(), value_type()));
+    return block->values;
+  }
+};
+
+/*
+  Writable view of the values of a Map, obtained once from Map::write() or
+  Map::discard() so that element access does not check for sharing. Valid
+  until the Map is copied into, reassigned or destroyed.
+*/
+class MapView {
+ private:
+  double* values;
+  size_t nj;
+
+ public:
+  MapView(double* values, size_t nj) :values(values), nj(nj) {}
+
+  double& operator()(size_t i, size_t j) const { return values[i*nj + j]; }
+
+  // Pointer to the start of row i
+  double* row(size_t i) const { return values + i*nj; }
+
+  double* data() const { return values; }
+};
+
+/*
+  Contiguous 2D array with shape (ni, nj) stored in row-major order. Copies
+  share storage until written (see SharedArray); write through a MapView.
+*/
+class Map {
+ private:
+  size_t ni, nj;
+  SharedArray<AlignedVector> values;
+
+ public:
+  Map() :ni(0), nj(0) {}
+  Map(size_t ni, size_t nj, double value=0.0)
+    :ni(ni), nj(nj), values(ni*nj, value) {}
+
+  void assign(size_t ni_new, size_t nj_new, double value=0.0) {
+    ni = ni_new;
+    nj = nj_new;
+    values.assign(ni*nj, value);
+  }
+  void fill(double value) { values.assign(ni*nj, value); }
+
+  MapView write() { return MapView(values.write().data(), nj); }
+
+  // View of storage whose values will all be overwritten
+  MapView discard() { return MapView(values.discard().data(), nj); }
+
+  size_t get_ni() const { return ni; }
+  size_t get_nj() const { return nj; }
+  size_t size() const { return ni*nj; }
+
+  double operator()(size_t i, size_t j) const
+  { return values.read()[i*nj + j]; }
+
+  // Pointer to the start of row i
+  const double* row(size_t i) const { return values.read().data() + i*nj; }
+
+  const double* data() const { return values.read().data(); }
+};
+
+/*
+  Writable view of the values of a Cube, as for MapView.
+*/
+class CubeView {
+ private:
+  double* values;
+  size_t nj, nr;
+
+ public:
+  CubeView(double* values, size_t nj, size_t nr)
+    :values(values), nj(nj), nr(nr) {}
+
+  double& operator()(size_t i, size_t j, size_t r) const
+  { return values[(i*nj + j)*nr + r]; }
+
+  // Pointer to the start of the spectrum at spaxel (i, j)
+  double* spectrum(size_t i, size_t j) const
+  { return values + (i*nj + j)*nr; }
+
+  // Pointer to the start of the spectrum at spaxel n (flattened i*nj + j)
+  double* spectrum(size_t n) const { return values + n*nr; }
+
+  double* data() const { return values; }
+};
+
+/*
+  Contiguous 3D array with shape (ni, nj, nr) stored in row-major order, such
+  that the spectrum of each spaxel (i, j) is contiguous in memory. Copies
+  share storage until written (see SharedArray); write through a CubeView.
+*/
+class Cube {
+ private:
+  size_t ni, nj, nr;
+  SharedArray<AlignedVector> values;
+
+ public:
+  Cube() :ni(0), nj(0), nr(0) {}
+  Cube(size_t ni, size_t nj, size_t nr, double value=0.0)
+    :ni(ni), nj(nj), nr(nr), values(ni*nj*nr, value) {}
+
+  void assign(size_t ni_new, size_t nj_new, size_t nr_new, double value=0.0) {
+    ni = ni_new;
+    nj = nj_new;
+    nr = nr_new;
+    values.assign(ni*nj*nr, value);
+  }
+  void fill(double value) { values.assign(ni*nj*nr, value); }
+
+  CubeView write() { return CubeView(values.write().data(), nj, nr); }
+
+  // View of storage whose values will all be overwritten
+  CubeView discard() { return CubeView(values.discard().data(), nj, nr); }
+
+  size_t get_ni() const { return ni; }
+  size_t get_nj() const { return nj; }
+  size_t get_nr() const { return nr; }
+  size_t size() const { return ni*nj*nr; }
+
+  // Offset of spectrum (i, j) from the start of the cube
+  size_t offset(size_t i, size_t j) const { return (i*nj + j)*nr; }
+
+  double operator()(size_t i, size_t j, size_t r) const
+  { return values.read()[(i*nj + j)*nr + r]; }
+
+  // Pointer to the start of the spectrum at spaxel (i, j)
+  const double* spectrum(size_t i, size_t j) const
+  { return values.read().data() + offset(i, j); }
+
+  // Pointer to the start of the spectrum at spaxel n (flattened i*nj + j)
+  const double* spectrum(size_t n) const
+  { return values.read().data() + n*nr; }
+
+  const double* data() const { return values.read().data(); }
+};
+
+#endif  // BLOBBY3D_CUBE_H_
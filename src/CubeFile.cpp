@@ -0,0 +1,172 @@
+#include "CubeFile.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char magic[8] = {'B', '3', 'D', 'C', 'U', 'B', 'E', '\0'};
+
+bool host_little_endian() {
+  const uint16_t probe = 1;
+  unsigned char byte;
+  std::memcpy(&byte, &probe, 1);
+  return byte == 1;
+}
+
+uint64_t load_le(const unsigned char* bytes, int size) {
+  uint64_t value = 0;
+  for (int b=size-1; b>=0; b--)
+    value = (value << 8) | bytes[b];
+  return value;
+}
+
+uint32_t load_uint32(const unsigned char* bytes) {
+  return static_cast<uint32_t>(load_le(bytes, 4));
+}
+
+int64_t load_int64(const unsigned char* bytes) {
+  return static_cast<int64_t>(load_le(bytes, 8));
+}
+
+double load_float64(const unsigned char* bytes) {
+  uint64_t bits = load_le(bytes, 8);
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+float load_float32(const unsigned char* bytes) {
+  uint32_t bits = static_cast<uint32_t>(load_le(bytes, 4));
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+CubeHeader parse_header(
+    const unsigned char* bytes, const std::string& filepath) {
+  if (std::memcmp(bytes, magic, sizeof(magic)) != 0) {
+    std::cerr<<"# ERROR: "<<filepath<<" is not a binary cube."<<std::endl;
+    exit(0);
+  }
+
+  CubeHeader header;
+  header.version = load_uint32(bytes + 8);
+  header.value_size = load_uint32(bytes + 12);
+  header.ni = load_int64(bytes + 16);
+  header.nj = load_int64(bytes + 24);
+  header.nr = load_int64(bytes + 32);
+  header.x_min = load_float64(bytes + 40);
+  header.x_max = load_float64(bytes + 48);
+  header.y_min = load_float64(bytes + 56);
+  header.y_max = load_float64(bytes + 64);
+  header.r_min = load_float64(bytes + 72);
+  header.r_max = load_float64(bytes + 80);
+
+  if (header.version != CubeFile::version) {
+    std::cerr<<"# ERROR: unsupported binary cube version "<<header.version;
+    std::cerr<<" in "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  if (header.value_size != 4 && header.value_size != 8) {
+    std::cerr<<"# ERROR: unsupported value size "<<header.value_size;
+    std::cerr<<" in "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  if (header.ni <= 0 || header.nj <= 0 || header.nr <= 0) {
+    std::cerr<<"# ERROR: strange cube shape in "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  return header;
+}
+
+}  // namespace
+
+bool CubeFile::is_binary(const std::string& filepath) {
+  std::ifstream fin(filepath, std::ios::in | std::ios::binary);
+  char bytes[sizeof(magic)];
+  if (!fin.read(bytes, sizeof(bytes)))
+    return false;
+  return std::memcmp(bytes, magic, sizeof(magic)) == 0;
+}
+
+CubeHeader CubeFile::read_header(const std::string& filepath) {
+  std::ifstream fin(filepath, std::ios::in | std::ios::binary);
+  unsigned char bytes[header_size];
+  if (!fin.read(reinterpret_cast<char*>(bytes), header_size)) {
+    std::cerr<<"# ERROR: couldn't read header of "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  return parse_header(bytes, filepath);
+}
+
+Cube CubeFile::read(const std::string& filepath, int ni, int nj, int nr) {
+  int fd = open(filepath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr<<"# ERROR: couldn't open file "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < header_size) {
+    std::cerr<<"# ERROR: couldn't read header of "<<filepath<<"."<<std::endl;
+    close(fd);
+    exit(0);
+  }
+
+  size_t length = static_cast<size_t>(st.st_size);
+  void* mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    std::cerr<<"# ERROR: couldn't map file "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+  madvise(mapped, length, MADV_SEQUENTIAL);
+
+  const unsigned char* bytes = static_cast<const unsigned char*>(mapped);
+  CubeHeader header = parse_header(bytes, filepath);
+
+  if (header.ni != ni || header.nj != nj || header.nr != nr) {
+    std::cerr<<"# ERROR: "<<filepath<<" has shape (";
+    std::cerr<<header.ni<<", "<<header.nj<<", "<<header.nr;
+    std::cerr<<"), expected ("<<ni<<", "<<nj<<", "<<nr<<")."<<std::endl;
+    munmap(mapped, length);
+    exit(0);
+  }
+
+  Cube cube(ni, nj, nr);
+  size_t size = cube.size();
+  if (length < header_size + size*header.value_size) {
+    std::cerr<<"# ERROR: "<<filepath<<" is truncated."<<std::endl;
+    munmap(mapped, length);
+    exit(0);
+  }
+
+  // Values are row-major, which matches the cube memory layout
+  const unsigned char* values = bytes + header_size;
+  double* out = cube.write().data();
+  if (header.value_size == 8 && host_little_endian()) {
+    std::memcpy(out, values, size*sizeof(double));
+  } else if (header.value_size == 8) {
+    for (size_t n=0; n<size; n++)
+      out[n] = load_float64(values + 8*n);
+  } else {
+    for (size_t n=0; n<size; n++)
+      out[n] = load_float32(values + 4*n);
+  }
+
+  munmap(mapped, length);
+
+  return cube;
+}
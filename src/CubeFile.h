@@ -0,0 +1,52 @@
+#ifndef BLOBBY3D_CUBEFILE_H_
+#define BLOBBY3D_CUBEFILE_H_
+
+#include <cstdint>
+#include <string>
+
+#include "Cube.h"
+
+/*
+  Binary cube files.
+
+  A 128 byte little-endian header followed by the ni*nj*nr values in
+  row-major (i, j, r) order, which matches the Cube memory layout:
+
+    offset  type       field
+         0  char[8]    magic "B3DCUBE\0"
+         8  uint32     format version (1)
+        12  uint32     bytes per value (4 = float32, 8 = float64)
+        16  int64[3]   ni, nj, nr
+        40  float64[6] x_min, x_max, y_min, y_max, r_min, r_max
+        88             reserved (zero)
+
+  The header carries the same information as metadata.txt, so a binary data
+  file replaces the metadata file. Files are memory mapped, so loading costs
+  a copy (or float32 conversion) instead of text parsing.
+*/
+struct CubeHeader {
+  uint32_t version;
+  uint32_t value_size;
+  int64_t ni, nj, nr;
+  double x_min, x_max;
+  double y_min, y_max;
+  double r_min, r_max;
+};
+
+class CubeFile
+{
+ public:
+  static const int header_size = 128;
+  static const uint32_t version = 1;
+
+  // True if the file starts with the binary cube magic
+  static bool is_binary(const std::string& filepath);
+
+  // Read the header of a binary cube file, exits on malformed input
+  static CubeHeader read_header(const std::string& filepath);
+
+  // Read a binary cube file, which must have shape (ni, nj, nr)
+  static Cube read(const std::string& filepath, int ni, int nj, int nr);
+};
+
+#endif  // BLOBBY3D_CUBEFILE_H_
@@ -8,6 +8,29 @@
 #include <algorithm>
 
 #include "Constants.h"
+#include "CubeFile.h"
+#include "FitsFile.h"
+#include "LineProfile.h"
+#include "LookupExp.h"
+#include "LookupErf.h"
+
+namespace {
+
+bool read_flag(std::istringstream& lin, const std::string& name) {
+  std::string value;
+  lin >> value;
+  std::transform(value.begin(), value.end(), value.begin(), ::toupper);
+  if ((value == "FALSE") || (value == "0")) {
+    return false;
+  } else if ((value == "TRUE") || (value == "1")) {
+    return true;
+  }
+
+  std::cerr<<"# ERROR: couldn't determine "<<name<<"."<<std::endl;
+  exit(0);
+}
+
+}  // namespace
 
 Data Data::instance;
 
@@ -53,6 +76,53 @@ void Data::load(const char* moptions_file) {
       lin >> var_file;
     } else if (name == "CONVOLVE_METHOD") {
       lin >> convolve;
+    } else if (name == "GAUSSIAN_METHOD") {
+      lin >> tmp_str;
+      std::transform(
+        tmp_str.begin(), tmp_str.end(),
+        tmp_str.begin(), ::toupper);
+      if (tmp_str == "COST") {
+        gaussian_method = -2;
+      } else if (tmp_str == "AUTO") {
+        gaussian_method = -1;
+      } else if (tmp_str == "SEPARABLE") {
+        gaussian_method = 0;
+      } else if (tmp_str == "LOWRANK") {
+        gaussian_method = 1;
+      } else if (tmp_str == "DIRECT") {
+        gaussian_method = 2;
+      } else {
+        std::cerr<<"# ERROR: couldn't determine GAUSSIAN_METHOD."<<std::endl;
+        exit(0);
+      }
+    } else if (name == "MODEL_THREADS") {
+      lin >> model_threads;
+    } else if (name == "SAVE_MAPS") {
+      save_maps = read_flag(lin, name);
+    } else if (name == "SAVE_PRECONVOLVED") {
+      save_preconvolved = read_flag(lin, name);
+    } else if (name == "SAVE_CONVOLVED") {
+      save_convolved = read_flag(lin, name);
+    } else if (name == "SAMPLE_FORMAT") {
+      lin >> tmp_str;
+      std::transform(
+        tmp_str.begin(), tmp_str.end(),
+        tmp_str.begin(), ::toupper);
+      if (tmp_str == "TEXT") {
+        sample_value_size = 0;
+      } else if (tmp_str == "PARAMETERS") {
+        sample_value_size = 0;
+        sample_parameters_only = true;
+      } else if (tmp_str == "FLOAT32") {
+        sample_value_size = 4;
+      } else if (tmp_str == "FLOAT64") {
+        sample_value_size = 8;
+      } else {
+        std::cerr<<"# ERROR: couldn't determine SAMPLE_FORMAT."<<std::endl;
+        exit(0);
+      }
+    } else if (name == "SAMPLE_PRODUCTS_FILE") {
+      lin >> sample_products_file;
     } else if (name == "PSFWEIGHT") {
       while (lin >> tmp_double)
         psf_amp.push_back(tmp_double);
@@ -244,57 +314,122 @@ void Data::load(const char* moptions_file) {
   // Spatial sampling of cube
   sample = 1;
 
-  // Read in the metadata
-  fin.open(metadata_file, std::ios::in);
-  if (!fin)
-    std::cerr<<"# ERROR: couldn't open file "<<metadata_file<<"."<<std::endl;
-  fin >> ni >> nj;
-  fin >> nr;
-  fin >> x_min >> x_max >> y_min >> y_max;
-  fin >> r_min >> r_max;
-  fin.close();
+  /*
+    Read in the metadata, from the header of a binary data cube or the WCS of
+    a FITS data cube if given
+  */
+  bool binary_data = CubeFile::is_binary(data_file);
+  if (binary_data || FitsFile::is_fits(data_file)) {
+    CubeHeader header = binary_data ?
+      CubeFile::read_header(data_file) : FitsFile::read_header(data_file);
+    ni = header.ni;
+    nj = header.nj;
+    nr = header.nr;
+    x_min = header.x_min;
+    x_max = header.x_max;
+    y_min = header.y_min;
+    y_max = header.y_max;
+    r_min = header.r_min;
+    r_max = header.r_max;
+    metadata_file = data_file;
+  } else {
+    fin.open(metadata_file, std::ios::in);
+    if (!fin)
+      std::cerr<<"# ERROR: couldn't open file "<<metadata_file<<"."<<std::endl;
+    fin >> ni >> nj;
+    fin >> nr;
+    fin >> x_min >> x_max >> y_min >> y_max;
+    fin >> r_min >> r_max;
+    fin.close();
+  }
   std::cout<<"Metadata Loaded..."<<std::endl;
 
   // Make sure maximum > minimum
   if (x_max <= x_min || y_max <= y_min)
     std::cerr<<"# ERROR: strange input in "<<metadata_file<<"."<<std::endl;
 
-  data = read_cube(data_file);
+  Cube data = read_cube(data_file);
   std::cout<<"Image Loaded...\n";
 
-  var = read_cube(var_file);
+  Cube var = read_cube(var_file);
   std::cout<<"Variance Loaded...\n";
 
+  /*
+    Voxels with a missing (blank or non-finite) data or variance value are
+    excluded by setting both to zero.
+  */
+  double* data_values = data.write().data();
+  double* var_values = var.write().data();
+  for (size_t n=0; n<data.size(); n++) {
+    if (!std::isfinite(data_values[n]) || !std::isfinite(var_values[n])) {
+      data_values[n] = 0.0;
+      var_values[n] = 0.0;
+    }
+  }
+
   /*
     Determine the valid data pixels
     Considered valid if sigma > 0.0 and there is at least 1 non-zero value.
    */
-  valid.assign(1, std::vector<int>(2));
+  valid.clear();
+  valid_index.assign(data.get_ni()*data.get_nj(), -1);
   double tmp_im, tmp_sig;
-  std::vector<int> tmp_vec(2);
-  nv = 0;
-  for (size_t i=0; i<data.size(); i++) {
-    for(size_t j=0; j<data[i].size(); j++) {
+  Spaxel spaxel;
+  for (size_t i=0; i<data.get_ni(); i++) {
+    for(size_t j=0; j<data.get_nj(); j++) {
+      const double* data_spec = data.spectrum(i, j);
+      const double* var_spec = var.spectrum(i, j);
       tmp_im = 0.0;
       tmp_sig = 0.0;
-      for (size_t r=0; r<data[i][j].size(); r++) {
-        if (data[i][j][r] != 0.0) { tmp_im = 1.0; }
-        tmp_sig += var[i][j][r];
+      for (size_t r=0; r<data.get_nr(); r++) {
+        if (data_spec[r] != 0.0) { tmp_im = 1.0; }
+        tmp_sig += var_spec[r];
 	    }
 
       // Add valid pixels to array
       if ((tmp_im == 1.0) && (tmp_sig > 0.0)) {
-        tmp_vec[0] = i;
-        tmp_vec[1] = j;
-
-        if (nv != 0)
-          valid.push_back(tmp_vec);
-        else
-          valid[0] = tmp_vec;
+        spaxel.i = i;
+        spaxel.j = j;
+        valid_index[i*data.get_nj() + j] = valid.size();
+        valid.push_back(spaxel);
+      }
+    }
+  }
+  nv = valid.size();
 
-        nv += 1;
+  /*
+    Pack the spectra of the valid spaxels. The full cubes are released when
+    load returns, so only the valid spectra stay resident.
+  */
+  var_levels.assign(1, 0.0);
+  for (int h=0; h<nv; h++) {
+    const double* var_spec = var.spectrum(valid[h].i, valid[h].j);
+    for (int r=0; r<nr; r++)
+      if (var_spec[r] != 0.0)
+        var_levels.push_back(var_spec[r]);
+  }
+  std::sort(var_levels.begin() + 1, var_levels.end());
+  var_levels.erase(
+    std::unique(var_levels.begin() + 1, var_levels.end()), var_levels.end());
+
+  valid_data.assign(static_cast<size_t>(nv)*nr, 0.0);
+  valid_level.assign(static_cast<size_t>(nv)*nr, 0);
+  valid_log_norm.assign(nv, 0.0);
+  for (int h=0; h<nv; h++) {
+    const double* data_spec = data.spectrum(valid[h].i, valid[h].j);
+    const double* var_spec = var.spectrum(valid[h].i, valid[h].j);
+    std::copy(data_spec, data_spec + nr, valid_data.begin() + h*nr);
+
+    int n = 0;
+    for (int r=0; r<nr; r++) {
+      if (var_spec[r] != 0.0) {
+        valid_level[h*nr + r] = std::lower_bound(
+          var_levels.begin() + 1, var_levels.end(), var_spec[r])
+          - var_levels.begin();
+        n++;
       }
     }
+    valid_log_norm[h] = -0.5*n*log(2.0*M_PI);
   }
   std::cout<<"Valid pixels determined...\n\n";
 
@@ -356,33 +491,23 @@ void Data::load(const char* moptions_file) {
   summarise_model();
 }
 
-std::vector< std::vector< std::vector<double> > > Data::arr_3d() {
-  std::vector< std::vector< std::vector<double> > > arr;
-  // Create 3D array with shape (ni, nj, nr)
-  arr.resize(ni);
-  for (int i=0; i<ni; i++) {
-    arr[i].resize(nj);
-    for(int j=0; j<nj; j++) {
-      arr[i][j].resize(nr);
-    }
-  }
-
-  return arr;
-}
+Cube Data::read_cube(std::string filepath) {
+  // Read data file into a cube with shape (ni, nj, nr)
+  if (CubeFile::is_binary(filepath))
+    return CubeFile::read(filepath, ni, nj, nr);
+  if (FitsFile::is_fits(filepath))
+    return FitsFile::read(filepath, ni, nj, nr);
 
-std::vector< std::vector< std::vector<double> > >
-  Data::read_cube (std::string filepath) {
-  // Read data file
-  std::vector< std::vector< std::vector<double> > > cube = arr_3d();
+  Cube cube(ni, nj, nr);
   std::fstream fin(filepath, std::ios::in);
 
   if (!fin)
     std::cerr<<"# ERROR: couldn't open file "<<filepath<<"."<<std::endl;
 
-  for (size_t i=0; i<cube.size(); i++)
-    for (size_t j=0; j<cube[i].size(); j++)
-      for (size_t r=0; r<cube[i][j].size(); r++)
-        fin >> cube[i][j][r];
+  // File is in row-major order, which matches the cube memory layout
+  double* values = cube.write().data();
+  for (size_t n=0; n<cube.size(); n++)
+    fin >> values[n];
   fin.close();
 
   return cube;
@@ -390,19 +515,27 @@ std::vector< std::vector< std::vector<double> > >
 
 void Data::compute_ray_grid() {
   // Make vectors of the correct size
-  x.assign(ni, std::vector<double>(nj));
-  y.assign(ni, std::vector<double>(nj));
-
-  for (size_t i=0; i<x.size(); i++) {
-    for (size_t j=0; j<x[i].size(); j++) {
-      x[i][j] = x_min + (j + 0.5)*dx;
-      y[i][j] = y_min + (i + 0.5)*dy; // Assuming origin=lower
+  x.assign(ni, nj);
+  y.assign(ni, nj);
+  const MapView x_out = x.write();
+  const MapView y_out = y.write();
+
+  for (size_t i=0; i<x.get_ni(); i++) {
+    for (size_t j=0; j<x.get_nj(); j++) {
+      x_out(i, j) = x_min + (j + 0.5)*dx;
+      y_out(i, j) = y_min + (i + 0.5)*dy; // Assuming origin=lower
     }
   }
 
   r.assign(nr, 0.0);
   for(size_t k=0; k<r.size(); k++)
     r[k] = r_min + (k + 0.5)*dr;
+
+  // Wavelength bin edges, nr + 1 in total
+  r_edges.assign(nr + 1, 0.0);
+  r_edges[0] = r[0] - 0.5*dr;
+  for(size_t k=0; k<r.size(); k++)
+    r_edges[k+1] = r[k] + 0.5*dr;
 }
 
 void Data::summarise_model() {
@@ -437,7 +570,7 @@ void Data::summarise_model() {
       std::cout<<psf_amp[i]<<" ";
     std::cout<<std::endl;
   } else if (convolve == 1) {
-    std::cout<<"Moffat (WARNING: Not safe for multi-threading)."<<std::endl;
+    std::cout<<"Moffat."<<std::endl;
     std::cout<<"PSF_BETA: "<<psf_beta<<std::endl;
   }
   std::cout<<"PSF_FWHM: ";
@@ -445,6 +578,28 @@ void Data::summarise_model() {
     std::cout<<psf_fwhm[i]<<" ";
   std::cout<<std::endl;
   std::cout<<"LSF_FWHM (Gauss Instr. Broadening): "<<lsf_fwhm<<std::endl;
+  std::cout<<"Threads per model: "<<model_threads<<std::endl;
+  std::cout<<"Sample products: ";
+  if (sample_parameters_only) {
+    std::cout<<"none, parameters only"<<std::endl;
+  } else {
+    if (sample_value_size == 0)
+      std::cout<<"text in sample.txt";
+    else
+      std::cout<<"float"<<8*sample_value_size<<" in "<<sample_products_file;
+    std::cout<<" (maps "<<save_maps<<", preconvolved "<<save_preconvolved;
+    std::cout<<", convolved "<<save_convolved<<")"<<std::endl;
+  }
+  std::cout
+    <<"Line profile instruction set: "
+    <<LineProfile::get_instruction_set()<<std::endl;
+  std::cout
+    <<"Lookup table instruction set: "
+    <<LookupBatch::get_instruction_set()<<std::endl;
+  std::cout
+    <<"Lookup table max error: exp "
+    <<LookupExp::get_table().get_max_error()
+    <<", erf "<<LookupErf::get_table().get_max_error()<<std::endl;
   std::cout<<"i: "<<inc<<std::endl;
 
   std::cout<<dashline<<std::endl;
@@ -2,11 +2,19 @@
 #define BLOBBY3D_DATA_H_
 
 #include <cmath>
+#include <cstdint>
 #include <vector>
 #include <string>
 
 #include "Constants.h"
+#include "Cube.h"
 
+/*
+  Coordinates of a spaxel.
+*/
+struct Spaxel {
+  int i, j;
+};
 
 class Data
 {
@@ -17,12 +25,22 @@ class Data
   std::string data_file = "data.txt";
   std::string var_file = "var.txt";
 
+  // sample output, text in sample.txt unless a value size is given
+  bool save_maps = true;
+  bool save_preconvolved = true;
+  bool save_convolved = true;
+  int sample_value_size = 0;
+  bool sample_parameters_only = false;
+  std::string sample_products_file = "sample_products.b3d";
+
   // model parameters
   std::vector< std::vector<double> > em_line;
   int model = 0;
   int nmax = 300;
   bool nfixed = false;
   int convolve = 0;
+  int gaussian_method = -2;  // -2 fewest operations, -1 fastest measured
+  int model_threads = 1;
   double vsys_gamma = 30.0;
   double vsys_max = 150.0;
   double vmax_min = 40.0;
@@ -123,21 +141,32 @@ class Data
   double x_imcentre, y_imcentre;
 
   // Coordinates of pixel centers
-  std::vector< std::vector<double> > x;
-  std::vector< std::vector<double> > y;
+  Map x;
+  Map y;
   std::vector<double> r;
-
-  // Data
-  std::vector< std::vector< std::vector<double> > > data;
-  std::vector< std::vector< std::vector<double> > > var;
+  std::vector<double> r_edges;
 
   // Valid spaxels
-  std::vector< std::vector<int> > valid;
+  std::vector<Spaxel> valid;
+
+  // Index into valid for each spaxel (flattened i*nj + j), -1 if not valid
+  std::vector<int> valid_index;
+
+  /*
+    Data spectra of the valid spaxels, packed contiguously in the order of
+    valid. The variance of each voxel is stored as an index into the sorted
+    distinct variance values, var_levels, whose first value is zero. Voxels
+    with zero variance are excluded from the likelihood.
+  */
+  AlignedVector valid_data;
+  std::vector<uint32_t> valid_level;
+  std::vector<double> var_levels;
+
+  // Constant log-normalisation of each valid spectrum, -0.5*n*log(2*pi)
+  std::vector<double> valid_log_norm;
 
   // Private functions
-  std::vector< std::vector< std::vector<double> > > arr_3d();
-  std::vector< std::vector< std::vector<double> > >
-    read_cube(std::string filepath);
+  Cube read_cube(std::string filepath);
   void summarise_model();
   void compute_ray_grid();
 
@@ -150,6 +179,15 @@ class Data
   int get_nmax() const { return nmax; }
   bool get_nfixed() const { return nfixed; }
   int get_convolve() const { return convolve; }
+  int get_gaussian_method() const { return gaussian_method; }
+  int get_model_threads() const { return model_threads; }
+  bool get_save_maps() const { return save_maps; }
+  bool get_save_preconvolved() const { return save_preconvolved; }
+  bool get_save_convolved() const { return save_convolved; }
+  int get_sample_value_size() const { return sample_value_size; }
+  bool get_sample_parameters_only() const { return sample_parameters_only; }
+  const std::string& get_sample_products_file() const
+  { return sample_products_file; }
   int get_ni() const { return ni; }
   int get_nj() const { return nj; }
   int get_nr() const { return nr; }
@@ -164,7 +202,8 @@ class Data
   double get_dy() const { return dy; }
   double get_dr() const { return dr; }
   double get_db() const { return db; }
-  std::vector< std::vector<double> > get_em_line() { return em_line; }
+  const std::vector< std::vector<double> >& get_em_line() const
+  { return em_line; }
   std::vector<double> get_psf_amp() const { return psf_amp; }
   std::vector<double> get_psf_fwhm() const { return psf_fwhm; }
   double get_psf_beta() const { return psf_beta; }
@@ -238,18 +277,18 @@ class Data
   double get_x_pad_dxos() const { return x_pad_dxos; }
   double get_y_pad_dyos() const { return y_pad_dyos; }
 
-  const std::vector< std::vector<double> >& get_x() const
-  { return x; }
-  const std::vector< std::vector<double> >& get_y() const
-  { return y; }
-  const std::vector<double>& get_r() const
-  { return r; }
-  const std::vector< std::vector< std::vector<double> > >& get_data() const
-  { return data; }
-  const std::vector< std::vector< std::vector<double> > >& get_var() const
-  { return var; }
-  const std::vector< std::vector<int> >& get_valid() const
-  { return valid; }
+  const Map& get_x() const { return x; }
+  const Map& get_y() const { return y; }
+  const std::vector<double>& get_r() const { return r; }
+  const std::vector<double>& get_r_edges() const { return r_edges; }
+  const std::vector<Spaxel>& get_valid() const { return valid; }
+  const std::vector<int>& get_valid_index() const { return valid_index; }
+  const double* get_valid_data(int h) const
+  { return valid_data.data() + static_cast<size_t>(h)*nr; }
+  const uint32_t* get_valid_level(int h) const
+  { return valid_level.data() + static_cast<size_t>(h)*nr; }
+  const std::vector<double>& get_var_levels() const { return var_levels; }
+  double get_valid_log_norm(int h) const { return valid_log_norm[h]; }
 
   // Singleton
  private:
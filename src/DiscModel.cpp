@@ -1,13 +1,16 @@
 #include "DiscModel.h"
 
 #include <cmath>
+#include <algorithm>
 
 #include "DNest4/code/DNest4.h"
 #include "Data.h"
 #include "LookupExp.h"
-#include "LookupErf.h"
+#include "LineProfile.h"
+#include "ThreadPool.h"
 #include "Conv.h"
 #include "Constants.h"
+#include "SampleWriter.h"
 
 // TODO: Remove references to sigma1 throughout code.
 // Partial fix: not perturbing.
@@ -39,60 +42,56 @@ DiscModel::DiscModel()
         ),
       DNest4::PriorType::log_uniform
       ),
-      model(Data::get_instance().get_model()) {
-  const size_t nlines = Data::get_instance().get_em_line().size();
-  const size_t ni = Data::get_instance().get_ni();
-  const size_t nj = Data::get_instance().get_nj();
-  const size_t nr = Data::get_instance().get_nr();
-  const size_t x_pad = Data::get_instance().get_x_pad();
-  const size_t y_pad = Data::get_instance().get_y_pad();
-  const double x_min = Data::get_instance().get_x_min();
+      context(&ModelContext::get_instance()),
+      model(Data::get_instance().get_model()),
+      flux_updates(0),
+      products_only(false) {
+  const size_t nlines = context->get_nlines();
+  const size_t ni = context->get_ni();
+  const size_t nj = context->get_nj();
+  const size_t nr = context->get_nr();
+  const size_t nv = context->get_nv();
+  const size_t x_pad = context->get_x_pad();
+  const size_t y_pad = context->get_y_pad();
+  const double x_min = context->get_x_min();
   const double x_max = Data::get_instance().get_x_max();
-  const double y_min = Data::get_instance().get_y_min();
+  const double y_min = context->get_y_min();
   const double y_max = Data::get_instance().get_y_max();
-  const double x_pad_dx = Data::get_instance().get_x_pad_dx();
-  const double y_pad_dy = Data::get_instance().get_y_pad_dy();
+  const double x_pad_dx = context->get_x_pad_dx();
+  const double y_pad_dy = context->get_y_pad_dy();
 
   /*
     initialise arrays
   */
   // model cube
-  preconvolved.resize(ni);
-  for (size_t i=0; i<ni; ++i) {
-    preconvolved[i].resize(nj);
-    for (size_t j=0; j<nj; ++j) {
-      preconvolved[i][j].resize(nr);
-    }
-  }
+  preconvolved.assign(ni, nj, nr);
 
   // Convolved cube
-  convolved.resize(ni - 2*y_pad);
-  for (size_t i=0; i<convolved.size(); i++) {
-    convolved[i].resize(nj - 2*x_pad);
-    for (size_t j=0; j<convolved[i].size(); j++) {
-        convolved[i][j].resize(nr);
-    }
-  }
+  convolved.assign(ni - 2*y_pad, nj - 2*x_pad, nr);
 
   // Shifted arrays
-  x_shft.assign(ni, std::vector<double>(nj));
-  y_shft.assign(ni, std::vector<double>(nj));
+  x_shft.assign(ni, nj);
+  y_shft.assign(ni, nj);
 
   // Radius and cos(angle) maps
-  rad.assign(ni, std::vector<double>(nj));
-  cos_angle.assign(ni, std::vector<double>(nj));
+  rad.assign(ni, nj);
+  cos_angle.assign(ni, nj);
 
   // Moment maps
-  flux.resize(nlines);
-  for (size_t i=0; i<flux.size(); i++) {
-    flux[i].resize(ni);
-    for (size_t j=0; j<flux[i].size(); j++) {
-      flux[i][j].resize(nj);
-    }
-  }
+  flux.assign(nlines, Map(ni, nj));
 
-  rel_lambda.assign(ni, std::vector<double>(nj));
-  vdisp.assign(ni, std::vector<double>(nj));
+  rel_lambda.assign(ni, nj);
+  vdisp.assign(ni, nj);
+
+  nprofiles = context->get_profiles().size();
+  window_first.assign(nprofiles*ni*nj, 0);
+  window_last.assign(nprofiles*ni*nj, 0);
+  logL_spaxel.assign(nv, 0.0);
+  noise_weight.assign(context->get_var_levels().size(), 0.0);
+  noise_log_var.assign(context->get_var_levels().size(), 0.0);
+  residual_sq.assign(nv*nr, 0.0);
+  log_norm.assign(nv, 0.0);
+  noise_sigma0 = -1.0;  // Not calculated yet
 
   /*
     Prior distributions
@@ -157,6 +156,8 @@ DiscModel::DiscModel()
 }
 
 void DiscModel::from_prior(DNest4::RNG& rng) {
+  products_only = false;
+
   /*
     Initialise: global parameters
   */
@@ -217,14 +218,17 @@ void DiscModel::from_prior(DNest4::RNG& rng) {
   else
     disc_flux_perturb = true;
 
-  calculate_cube();
+  calculate_cube(blobs.get_components());
 }
 
 double DiscModel::perturb(DNest4::RNG& rng) {
+  require_sampled("perturb");
+
   double logH = 0.0;
   double rnd = rng.rand();
 
   array_perturb = false;
+  blob_perturb = false;
   vel_perturb = false;
   vdisp_perturb = false;
   disc_flux_perturb = false;
@@ -241,6 +245,7 @@ double DiscModel::perturb(DNest4::RNG& rng) {
     if (rnd < 0.7) {
       // Perturb blob parameters
       logH += blobs.perturb(rng);
+      blob_perturb = true;
       if ((model == 0) & (blobs.get_components().size() == 0))
         return logH = -1E300;
 
@@ -308,7 +313,7 @@ double DiscModel::perturb(DNest4::RNG& rng) {
     // Pre-rejection trick
     if (log(rng.rand()) < logH) {
       logH = 0.0;
-      calculate_cube();
+      calculate_cube(blobs.get_components());
     } else {
       logH = -1E300;
     }
@@ -324,84 +329,61 @@ double DiscModel::perturb(DNest4::RNG& rng) {
         logH += prior_sigma1.perturb(sigma1, rng);
         break;
     }
+    calculate_noise_log_likelihood();
   }
 
   return logH;
 }
 
 double DiscModel::log_likelihood() const {
-  const std::vector< std::vector< std::vector<double> > >&
-    data = Data::get_instance().get_data();
-  const std::vector< std::vector< std::vector<double> > >&
-    var_cube = Data::get_instance().get_var();
-  const std::vector< std::vector<int> >&
-    valid = Data::get_instance().get_valid();
-
-  long double logL = 0.0;
+  require_sampled("log_likelihood");
 
   if ((model == 0) && (blobs.get_components().size() == 0)) {
     // If no blobs return prob = 0
-    logL = -1E300;
-
-  } else {
-    double var;
-    int i, j;
-
-    double sigma0sq = sigma0*sigma0;
-
-    for (size_t h=0; h<valid.size(); h++) {
-      i = valid[h][0];
-      j = valid[h][1];
-      for (size_t r=0; r<data[i][j].size(); r++) {
-        if (var_cube[i][j][r] != 0.0) {
-          var = var_cube[i][j][r] + sigma0sq;
-          logL += -0.5*log(2.0*M_PI*var);
-          logL += -0.5*pow(data[i][j][r] - convolved[i][j][r], 2)/var;
-        }
-      }
-    }
+    return -1E300;
   }
 
-  return logL;
+  return logL.value();
 }
 
 void DiscModel::print(std::ostream& out) const {
-  const int x_pad = Data::get_instance().get_x_pad();
-  const int y_pad = Data::get_instance().get_y_pad();
+  require_sampled("print");
 
-  const bool save_maps = true;
-  const bool save_preconvolved = true;
-  const bool save_convolved = true;
+  const int x_pad = context->get_x_pad();
+  const int y_pad = context->get_y_pad();
 
-  out<<std::setprecision(6);
+  const uint32_t products = context->get_save_products();
+  const bool save_maps = products & SampleWriter::save_maps;
+  const bool save_preconvolved = products & SampleWriter::save_preconvolved;
+  const bool save_convolved = products & SampleWriter::save_convolved;
 
-  if (save_maps) {
-    for (size_t l=0; l<flux.size(); l++)
-      for (size_t i=0; i<flux[l].size(); i++)
-        for (size_t j=0; j<flux[l][i].size(); j++)
-          out << flux[l][i][j] << ' ';
+  out<<std::setprecision(context->get_sample_precision());
 
-    for (size_t i=0; i<rel_lambda.size(); i++)
-      for (size_t j=0; j<rel_lambda[i].size(); j++)
-        out << (rel_lambda[i][j] - 1.0)*constants::C << ' ';
+  // Binary products are written by main once sampling is done
+  if (context->get_sample_value_size() == 0) {
+    if (save_maps) {
+      for (size_t l=0; l<flux.size(); l++)
+        for (size_t n=0; n<flux[l].size(); n++)
+          out << flux[l].data()[n] << ' ';
 
-    for (size_t i=0; i<vdisp.size(); i++)
-      for (size_t j=0; j<vdisp[i].size(); j++)
-        out << vdisp[i][j]*constants::C << ' ';
-  }
+      for (size_t n=0; n<rel_lambda.size(); n++)
+        out << (rel_lambda.data()[n] - 1.0)*constants::C << ' ';
 
-  if (save_preconvolved) {
-    for (size_t i=y_pad; i<preconvolved.size()-y_pad; i++)
-        for (size_t j=x_pad; j<preconvolved[i].size()-x_pad; j++)
-          for (size_t r=0; r<preconvolved[i][j].size(); r++)
-              out << preconvolved[i][j][r] << ' ';
-  }
+      for (size_t n=0; n<vdisp.size(); n++)
+        out << vdisp.data()[n]*constants::C << ' ';
+    }
 
-  if (save_convolved) {
-    for (size_t i=0; i<convolved.size(); i++)
-      for (size_t j=0; j<convolved[i].size(); j++)
-        for (size_t r=0; r<convolved[i][j].size(); r++)
-          out << convolved[i][j][r] << ' ';
+    if (save_preconvolved) {
+      for (size_t i=y_pad; i<preconvolved.get_ni()-y_pad; i++)
+        for (size_t j=x_pad; j<preconvolved.get_nj()-x_pad; j++)
+          for (size_t r=0; r<preconvolved.get_nr(); r++)
+            out << preconvolved(i, j, r) << ' ';
+    }
+
+    if (save_convolved) {
+      for (size_t n=0; n<convolved.size(); n++)
+        out << convolved.data()[n] << ' ';
+    }
   }
 
   // Save components
@@ -425,6 +407,103 @@ void DiscModel::print(std::ostream& out) const {
   out<<sigma1<<' ';
 }
 
+void DiscModel::write_products(SampleWriter& writer) const {
+  /*
+    Products are written in the same order and units as the text format.
+  */
+  const int x_pad = context->get_x_pad();
+  const int y_pad = context->get_y_pad();
+  const size_t ni = preconvolved.get_ni();
+  const size_t nj = preconvolved.get_nj();
+  const size_t nr = preconvolved.get_nr();
+
+  if (writer.get_products() & SampleWriter::save_maps) {
+    for (size_t l=0; l<flux.size(); l++)
+      writer.write(flux[l].data(), flux[l].size());
+    writer.write(rel_lambda.data(), rel_lambda.size(), -1.0, constants::C);
+    writer.write(vdisp.data(), vdisp.size(), 0.0, constants::C);
+  }
+
+  if (writer.get_products() & SampleWriter::save_preconvolved) {
+    for (size_t i=y_pad; i<ni-y_pad; i++)
+      writer.write(
+        preconvolved.spectrum(i, x_pad), (nj - 2*x_pad)*nr);
+  }
+
+  if (writer.get_products() & SampleWriter::save_convolved)
+    writer.write(convolved.data(), convolved.size());
+
+  writer.end_record();
+}
+
+bool DiscModel::read(std::istream& in) {
+  std::vector<double> values;
+  double value;
+  while (in >> value)
+    values.push_back(value);
+
+  /*
+    The parameters are the last values on the line: the RJObject (dimensions,
+    maximum components, hyperparameters, number of components and the
+    components by dimension, padded with zeros) followed by the global
+    parameters.
+  */
+  const int nlines = context->get_nlines();
+  const int ndim = 5 + nlines;
+  const int nmax = Data::get_instance().get_nmax();
+  const int nhyper = 4 + 2*nlines;
+  const int nglobal = 9 + (vdisp_order + 1) + 4;
+  const int nparam = 2 + nhyper + 1 + ndim*nmax + nglobal;
+  if (static_cast<int>(values.size()) < nparam)
+    return false;
+
+  const double* param = values.data() + values.size() - nparam;
+  if ((param[0] != ndim) || (param[1] != nmax))
+    return false;
+  param += 2 + nhyper;
+
+  const int ncomponents = static_cast<int>(param[0]);
+  if ((ncomponents < 0) || (ncomponents > nmax))
+    return false;
+  param += 1;
+
+  std::vector< std::vector<double> > components(
+    ncomponents, std::vector<double>(ndim));
+  for (int d=0; d<ndim; d++)
+    for (int k=0; k<ncomponents; k++)
+      components[k][d] = param[d*nmax + k];
+  param += ndim*nmax;
+
+  xcd = *param++;
+  ycd = *param++;
+  Md = *param++;
+  wxd = *param++;
+  vsys = *param++;
+  vmax = *param++;
+  vslope = *param++;
+  vgamma = *param++;
+  vbeta = *param++;
+  for (int i=0; i<vdisp_order+1; i++)
+    vdisp_param[i] = *param++;
+  inc = *param++;
+  pa = *param++;
+  sigma0 = *param++;
+  sigma1 = *param++;
+
+  // Reconstruct everything, as in from_prior
+  array_perturb = true;
+  vel_perturb = true;
+  vdisp_perturb = true;
+  blob_perturb = true;
+  noise_perturb = true;
+  disc_flux_perturb = (model != 0);
+
+  calculate_cube(components);
+  products_only = true;
+
+  return true;
+}
+
 std::string DiscModel::description() const {
   return std::string("blobs");
 }
@@ -432,12 +511,26 @@ std::string DiscModel::description() const {
 /*
   Private
 */
-void DiscModel::calculate_cube() {
+void DiscModel::require_sampled(const char* caller) const {
+  if (products_only) {
+    std::cerr<<"# ERROR: DiscModel::"<<caller<<" called on a model set by ";
+    std::cerr<<"read, which only holds its products."<<std::endl;
+    exit(0);
+  }
+}
+
+void DiscModel::calculate_cube(
+    const std::vector< std::vector<double> >& components) {
   /*
     Calculate cube as a function of model parameters.
   */
-  bool update;  // Determine if adding blobs
-  std::vector< std::vector<double> > components;
+  bool rebuild;  // Determine if flux map is recalculated from scratch
+
+  // Nothing is dirty between calculations
+  CubeWorkspace& ws = thread_workspace();
+  const size_t nspaxels = preconvolved.get_ni()*preconvolved.get_nj();
+  if (ws.dirty_mask.size() != nspaxels)
+    ws.dirty_mask.assign(nspaxels, 0);
 
   // Calculate position arrays
   if (array_perturb)
@@ -451,105 +544,198 @@ void DiscModel::calculate_cube() {
   if (vdisp_perturb || array_perturb)
     calculate_vdisp();
 
+  /*
+    Blob changes are applied to the flux map by subtracting the removed blobs
+    and adding the new ones. The map is rebuilt from scratch when the geometry
+    changes, when the update would touch as many blobs as a rebuild, and
+    periodically to stop round-off accumulating.
+  */
+  rebuild = array_perturb || (flux_updates >= max_flux_updates);
+  if (blob_perturb && !rebuild)
+    rebuild = (blobs.get_removed().size() + blobs.get_added().size()
+      >= components.size());
+
+  /*
+    Spectra only need reconstructing where the flux map changed, unless the
+    kinematic or flux maps change everywhere.
+  */
+  if (rebuild || array_perturb || vel_perturb || vdisp_perturb
+      || disc_flux_perturb || (model == 1))
+    mark_all_dirty(ws);
+
   //  Calculate flux map
   switch (model) {
     case 0:
       // Blobs only model
-      update = blobs.get_removed().size() == 0;
-      if (array_perturb || !update) {
+      if (rebuild) {
         clear_flux_map();
-        components = blobs.get_components();
-
-      } else {
-        components = blobs.get_added();
+        add_blob_flux(components, 1.0, ws);
+        flux_updates = 0;
+      } else if (blob_perturb) {
+        add_blob_flux(blobs.get_removed(), -1.0, ws);
+        add_blob_flux(blobs.get_added(), 1.0, ws);
+        flux_updates += 1;
       }
-      add_blob_flux(components);
       break;
     case 1:
       // Disc only model
-      update = false;
       clear_flux_map();
       if (disc_flux_perturb || array_perturb)
         add_disc_flux();
       break;
     case 2:
       // Disc + blobs model
-      update = blobs.get_removed().size() == 0;
-      if (disc_flux_perturb || array_perturb || !update) {
+      if (rebuild || disc_flux_perturb) {
         clear_flux_map();
-        components = blobs.get_components();
         add_disc_flux();
-
-      } else {
-        components = blobs.get_added();
+        add_blob_flux(components, 1.0, ws);
+        flux_updates = 0;
+      } else if (blob_perturb) {
+        add_blob_flux(blobs.get_removed(), -1.0, ws);
+        add_blob_flux(blobs.get_added(), 1.0, ws);
+        flux_updates += 1;
       }
-      add_blob_flux(components);
       break;
   }
 
-  construct_cube();
-  convolved = conv.apply(preconvolved);
+  /*
+    Convolution is linear, so when few spaxels changed the change in their
+    spectra can be convolved and added to the existing convolved cube. Only
+    the likelihood of the convolved spaxels that changed is then updated.
+  */
+  const size_t nr = preconvolved.get_nr();
+  bool incremental = (ws.dirty_spaxels.size() < nspaxels)
+    && conv.prefer_delta(ws.dirty_spaxels.size());
+
+  if (incremental) {
+    ws.delta_preconvolved.assign(ws.dirty_spaxels.size()*nr, 0.0);
+    accumulate_delta(-1.0, ws);
+  }
+
+  construct_cube(ws);
+
+  if (incremental) {
+    accumulate_delta(1.0, ws);
+    conv.apply_delta(
+      ws.dirty_spaxels, ws.delta_preconvolved, convolved,
+      ws.touched_spaxels);
+    update_log_likelihood(ws.touched_spaxels);
+    ws.delta_preconvolved.clear();
+    ws.touched_spaxels.clear();
+  } else {
+    calculate_active_slices(ws);
+    conv.apply(preconvolved, convolved, ws.active_slices);
+    calculate_log_likelihood();
+  }
+
+  clear_dirty(ws);
+}
+
+CubeWorkspace& DiscModel::thread_workspace() {
+  // Sized by the first calculation on each thread, then reused
+  static thread_local CubeWorkspace workspace;
+  return workspace;
 }
 
-void DiscModel::construct_cube() {
+void DiscModel::construct_cube(const CubeWorkspace& ws) {
   /*
     Create cube from maps.
   */
-  const std::vector< std::vector<double> >
-    em_line = Data::get_instance().get_em_line();
-
-  // clear cube where flux is 0
-  for (size_t i=0; i<preconvolved.size(); i++)
-    for (size_t j=0; j<preconvolved[i].size(); j++)
-        std::fill(preconvolved[i][j].begin(), preconvolved[i][j].end(), 0.0);
-
-  for (size_t l=0; l<em_line.size(); l++) {
-    // Apply flux for main line
-    construct_line_cube(em_line[l][0], 1.0, flux[l]);
-    for (size_t ll=0; ll<(em_line[l].size()-1)/2; ll++)
-      construct_line_cube(em_line[l][1+2*ll], em_line[l][2+2*ll], flux[l]);
+  const std::vector<LineProfileSpec>& profiles = context->get_profiles();
+
+  const size_t nr = preconvolved.get_nr();
+
+  /*
+    Spectra are independent, so chunks of dirty spaxels are shared out. The
+    storage is made unique before threads write to it, without copying the
+    old spectra when all of them are reconstructed.
+  */
+  const std::vector<int>& dirty_spaxels = ws.dirty_spaxels;
+  const CubeView out = (dirty_spaxels.size() == ws.dirty_mask.size())
+    ? preconvolved.discard() : preconvolved.write();
+  std::vector<int>& first = window_first.write();
+  std::vector<int>& last = window_last.write();
+
+  ThreadPool::get_instance().parallel_for(
+    dirty_spaxels.size(), spaxel_chunk,
+    [&](int begin, int end) {
+      // clear spectra that are being reconstructed
+      for (int h=begin; h<end; h++) {
+        double* spectrum = out.spectrum(dirty_spaxels[h]);
+        std::fill(spectrum, spectrum + nr, 0.0);
+      }
+
+      for (size_t p=0; p<profiles.size(); p++)
+        construct_line_cube(
+          profiles[p].wavelength, profiles[p].factor,
+          flux[profiles[p].flux_map], p, dirty_spaxels, begin, end,
+          out, first, last);
+    });
+}
+
+void DiscModel::calculate_active_slices(CubeWorkspace& ws) const {
+  /*
+    Mark the wavelength slices covered by any line profile window. Windows
+    are accumulated as +1 at the first bin and -1 after the last bin, so a
+    running sum is positive within at least one window.
+  */
+  const int nr = preconvolved.get_nr();
+  const std::vector<int>& first = window_first.read();
+  const std::vector<int>& last = window_last.read();
+  std::vector<int> count(nr + 1, 0);
+  std::vector<char>& active_slices = ws.active_slices;
+  active_slices.resize(nr);
+  for (size_t h=0; h<first.size(); h++) {
+    if (first[h] < last[h]) {
+      count[first[h]] += 1;
+      count[last[h]] -= 1;
+    }
+  }
+
+  int sum = 0;
+  for (int r=0; r<nr; r++) {
+    sum += count[r];
+    active_slices[r] = (sum > 0);
   }
 }
 
 void DiscModel::construct_line_cube(
-  double line, double factor, std::vector< std::vector<double> >& flux_map) {
+  double line, double factor, const Map& flux_map, int profile,
+  const std::vector<int>& spaxels, int begin, int end,
+  const CubeView& out, std::vector<int>& first, std::vector<int>& last)
+  const {
   // TODO: Long term this function should be taken out of the class and
   // generalised to take any flux, v, vdisp maps to construct a cube for a
   // given line.
-  const double sigma_lsfsq = pow(Data::get_instance().get_lsf_sigma(), 2);
-  const std::vector<double>& wave = Data::get_instance().get_r();
-  const double dr = Data::get_instance().get_dr();
+  const double sigma_lsfsq = context->get_lsf_sigmasq();
+  const std::vector<double>& edges = context->get_r_edges();
 
   double lambda;
   double sigma_lambda;
   double invtwo_wlsq;
-  double ha_cdf_min, ha_cdf_max;
-
-  double flux_sum = 0.0;
-  double flux_sum_map = 0.0;
-  for (size_t i=0; i<preconvolved.size(); i++) {
-    for (size_t j=0; j<preconvolved[i].size(); j++) {
-      // Calculate mean lambda for lines
-      lambda = line*rel_lambda[i][j];
-
-      // Calculate line width
-      sigma_lambda = line*vdisp[i][j];
-      invtwo_wlsq = 1.0/sqrt(2.0*(pow(sigma_lambda, 2) + sigma_lsfsq));
-
-      // Calculate flux for 1st wavelength bin
-      ha_cdf_min = LookupErf::evaluate((wave[0] - 0.5*dr - lambda)*invtwo_wlsq);
-      ha_cdf_max = LookupErf::evaluate((wave[0] + 0.5*dr - lambda)*invtwo_wlsq);
-      preconvolved[i][j][0] = 0.5*factor*flux_map[i][j]*(ha_cdf_max - ha_cdf_min);
-
-      // Loop through remaining bins
-      flux_sum_map += factor*flux_map[i][j];
-      for (size_t r=1; r<wave.size(); r++) {
-        ha_cdf_min = ha_cdf_max;
-        ha_cdf_max = LookupErf::evaluate((wave[r] + 0.5*dr - lambda)*invtwo_wlsq);
-        preconvolved[i][j][r] += 0.5*factor*flux_map[i][j]*(ha_cdf_max - ha_cdf_min);
-        flux_sum += 0.5*factor*flux_map[i][j]*(ha_cdf_max - ha_cdf_min);
-      }
-    }
+
+  const size_t nr = preconvolved.get_nr();
+
+  const size_t offset = profile*flux_map.size();
+
+  int n;
+  size_t w;
+  for (int h=begin; h<end; h++) {
+    n = spaxels[h];
+    w = offset + n;
+
+    // Calculate mean lambda for lines
+    lambda = line*rel_lambda.data()[n];
+
+    // Calculate line width
+    sigma_lambda = line*vdisp.data()[n];
+    invtwo_wlsq = 1.0/sqrt(2.0*(pow(sigma_lambda, 2) + sigma_lsfsq));
+
+    LineProfile::window(
+      edges.data(), nr, lambda, invtwo_wlsq, first[w], last[w]);
+    LineProfile::add(
+      edges.data(), first[w], last[w], lambda, invtwo_wlsq,
+      factor*flux_map.data()[n], out.spectrum(n));
   }
 }
 
@@ -557,10 +743,8 @@ void DiscModel::calculate_shifted_arrays() {
   /*
     Calculate arrays shifted by disk parameters.
   */
-  const std::vector< std::vector<double> >&
-    x = Data::get_instance().get_x();
-  const std::vector< std::vector<double> >&
-    y = Data::get_instance().get_y();
+  const Map& x = context->get_x();
+  const Map& y = context->get_y();
 
   double sin_pa = sin(pa);
   double cos_pa = cos(pa);
@@ -568,27 +752,32 @@ void DiscModel::calculate_shifted_arrays() {
 
   double xx_rot, yy_rot;
 
-  for (size_t i=0; i<preconvolved.size(); i++) {
-    for (size_t j=0; j<preconvolved[i].size(); j++) {
+  const MapView x_shft_out = x_shft.write();
+  const MapView y_shft_out = y_shft.write();
+  const MapView rad_out = rad.write();
+  const MapView cos_angle_out = cos_angle.write();
+
+  for (size_t i=0; i<preconvolved.get_ni(); i++) {
+    for (size_t j=0; j<preconvolved.get_nj(); j++) {
       // Shift
-      x_shft[i][j] = x[i][j] - xcd;
-      y_shft[i][j] = y[i][j] - ycd;
+      x_shft_out(i, j) = x(i, j) - xcd;
+      y_shft_out(i, j) = y(i, j) - ycd;
 
       // rotate by pa around z (counter-clockwise, East pa = 0)
-      xx_rot = x_shft[i][j]*cos_pa + y_shft[i][j]*sin_pa;
-      yy_rot = -x_shft[i][j]*sin_pa + y_shft[i][j]*cos_pa;
+      xx_rot = x_shft_out(i, j)*cos_pa + y_shft_out(i, j)*sin_pa;
+      yy_rot = -x_shft_out(i, j)*sin_pa + y_shft_out(i, j)*cos_pa;
 
       // rotate by inclination around yy_rot
       yy_rot *= invcos_inc;
 
       // calculate radius
-      rad[i][j] = sqrt(xx_rot*xx_rot + yy_rot*yy_rot);
+      rad_out(i, j) = sqrt(xx_rot*xx_rot + yy_rot*yy_rot);
 
       // calculate angle to receding major axis
       if ((xx_rot != 0.0) || (yy_rot != 0.0))
-        cos_angle[i][j] = cos(atan2(yy_rot, xx_rot));
+        cos_angle_out(i, j) = cos(atan2(yy_rot, xx_rot));
       else
-        cos_angle[i][j] = 1.0;
+        cos_angle_out(i, j) = 1.0;
     }
   }
 }
@@ -599,28 +788,40 @@ void DiscModel::add_disc_flux() {
     emission lines.
     TODO: Generalise Md, wxd to account for multiple emission lines.
   */
-  const double dx = Data::get_instance().get_dx();
-  const double dy = Data::get_instance().get_dy();
+  const double dx = context->get_dx();
+  const double dy = context->get_dy();
 
   double invwxd  = 1.0/wxd;
   double amp = dx*dy*Md*invwxd;
 
-  for (size_t l=0; l<flux.size(); l++)
-    for (size_t i=0; i<flux[l].size(); i++)
-      for(size_t j=0; j<flux[l][i].size(); j++)
-        flux[l][i][j] += amp*LookupExp::evaluate(rad[i][j]*invwxd);
+  // Profile is the same for all lines, so is evaluated once
+  const double* radius = rad.data();
+  const size_t n = rad.size();
+  std::vector<double> profile(n);
+  for (size_t h=0; h<n; h++)
+    profile[h] = radius[h]*invwxd;
+  LookupExp::evaluate(profile.data(), n, profile.data());
+
+  for (size_t l=0; l<flux.size(); l++) {
+    double* flux_map = flux[l].write().data();
+    for (size_t h=0; h<n; h++)
+      flux_map[h] += amp*profile[h];
+  }
 }
 
-void DiscModel::add_blob_flux(std::vector< std::vector<double> >& components) {
+void DiscModel::add_blob_flux(
+    const std::vector< std::vector<double> >& components, double sign,
+    CubeWorkspace& ws) {
   /*
-    Calculate flux map.
+    Add (sign = 1) or subtract (sign = -1) the flux of blob components to the
+    flux map.
   */
-  const double dx = Data::get_instance().get_dx();
-  const double dy = Data::get_instance().get_dy();
-  const double sigma_cutoffsq = pow(
-    Data::get_instance().get_sigma_cutoff(), 2);
-  const double pixel_width = Data::get_instance().get_pixel_width();
-  const size_t nlines = Data::get_instance().get_em_line().size();
+  const double dx = context->get_dx();
+  const double dy = context->get_dy();
+  const double sigma_cutoffsq = pow(context->get_sigma_cutoff(), 2);
+  const double pixel_width = context->get_pixel_width();
+  const size_t nlines = context->get_nlines();
+
 
   double sin_pa = sin(pa);
   double cos_pa = cos(pa);
@@ -649,6 +850,25 @@ void DiscModel::add_blob_flux(std::vector< std::vector<double> >& components) {
   double dxfs, dyfs;
   std::vector<double> amps(nlines);
 
+  // Flux maps are only copied if there is flux to add to them
+  if (components.empty())
+    return;
+  std::vector<MapView> flux_out;
+  for (size_t l=0; l<nlines; l++)
+    flux_out.push_back(flux[l].write());
+
+  // Spaxels covered by blob
+  Footprint fp;
+
+  /*
+    Arguments of the profile for each oversampled position in a row of the
+    footprint, evaluated together. Positions beyond the cutoff use the end
+    of the table, where the profile is zero.
+  */
+  const double beyond_cutoff = LookupExp::get_table().get_x_max();
+  std::vector<double> profile;
+  int ns, h;
+
   // Blob contribution
   for (size_t k=0; k<components.size(); ++k) {
     // Components
@@ -690,20 +910,25 @@ void DiscModel::add_blob_flux(std::vector< std::vector<double> >& components) {
 
     // Flux normalised sum
     for (size_t l=0; l<nlines; l++)
-      amp[l] = dxfs*dyfs*f[l]/(2.0*M_PI*wxsq*cos_inc);
+      amp[l] = sign*dxfs*dyfs*f[l]/(2.0*M_PI*wxsq*cos_inc);
 
-    for (size_t i=0; i<flux[0].size(); i++) {
-      for (size_t j=0; j<flux[0][i].size(); j++) {
-        for (size_t l=0; l<flux.size(); l++)
-          amps[l] = 0.0;
+    // Only visit spaxels within the truncated blob
+    fp = blob_footprint(components[k]);
+    mark_dirty(fp, ws);
+
+    ns = (2*si + 1)*(2*si + 1);
+    for (int i=fp.imin; i<=fp.imax; i++) {
+      profile.resize(std::max(fp.jmax - fp.jmin + 1, 0)*ns);
+      h = 0;
+      for (int j=fp.jmin; j<=fp.jmax; j++) {
         for (int is=-si; is<=si; is++) {
           for (int js=-si; js<=si; js++) {
             /*
               Get rotated/inc disk coordinates
             */
             // Shift
-            xd_shft = x_shft[i][j] + js*dxfs;
-            yd_shft = y_shft[i][j] + is*dyfs;
+            xd_shft = x_shft(i, j) + js*dxfs;
+            yd_shft = y_shft(i, j) + is*dyfs;
 
             // rotate by pa around z (counter-clockwise, East pa = 0)
             xxd_rot = xd_shft*cos_pa + yd_shft*sin_pa;
@@ -727,39 +952,116 @@ void DiscModel::add_blob_flux(std::vector< std::vector<double> >& components) {
             rsq = q*pow(xxb_rot, 2) + invq*pow(yyb_rot, 2);
             rsq *= invwxsq;
 
-            if (rsq < sigma_cutoffsq) {
-              for (size_t l=0; l<flux.size(); l++)
-                amps[l] += amp[l]*LookupExp::evaluate(0.5*rsq);
-            }
+            profile[h++] = (rsq < sigma_cutoffsq) ? 0.5*rsq : beyond_cutoff;
           }
         }
+      }
+
+      LookupExp::evaluate(profile.data(), profile.size(), profile.data());
+
+      h = 0;
+      for (int j=fp.jmin; j<=fp.jmax; j++) {
+        for (size_t l=0; l<flux.size(); l++)
+          amps[l] = 0.0;
+        for (int s=0; s<ns; s++, h++)
+          for (size_t l=0; l<flux.size(); l++)
+            amps[l] += amp[l]*profile[h];
         for (size_t l=0; l<flux.size(); l++)
-          flux[l][i][j] += amps[l];
+          flux_out[l](i, j) += amps[l];
       }
     }
   }
 }
 
+Footprint DiscModel::blob_footprint(
+    const std::vector<double>& component) const {
+  /*
+    Calculate the bounding box of the spaxels that a blob contributes flux to.
+
+    The blob is truncated at sigma_cutoff, which in the blob frame is an
+    ellipse with semi-axes sigma_cutoff*wx/sqrt(q) and sigma_cutoff*wx*sqrt(q).
+    The ellipse is rotated by phi, projected by the inclination and rotated by
+    pa onto the sky, where its axis-aligned extent is found analytically.
+    Spaxels are included if any part of them overlaps the extent, which
+    covers all oversampled positions used by add_blob_flux.
+  */
+  const double x_min = context->get_x_min();
+  const double y_min = context->get_y_min();
+  const double dx = context->get_dx();
+  const double dy = context->get_dy();
+  const double sigma_cutoff = context->get_sigma_cutoff();
+  const double ni = flux[0].get_ni();
+  const double nj = flux[0].get_nj();
+
+  double rc = component[0];
+  double thetac = component[1];
+  double wx = component[2];
+  double q = component[3];
+  double phi = component[4];
+
+  double sin_pa = sin(pa);
+  double cos_pa = cos(pa);
+  double cos_inc = cos(inc);
+  double sin_phi = sin(phi);
+  double cos_phi = cos(phi);
+
+  // Blob centre projected to the sky
+  double xc = rc*cos(thetac);
+  double yc = rc*sin(thetac)*cos_inc;
+  double xc_sky = xcd + xc*cos_pa - yc*sin_pa;
+  double yc_sky = ycd + xc*sin_pa + yc*cos_pa;
+
+  // Semi-axes of truncation ellipse
+  double a = sigma_cutoff*wx/sqrt(q);
+  double b = sigma_cutoff*wx*sqrt(q);
+
+  // Semi-axes after rotation by phi and projection by inclination
+  double ax = a*cos_phi;
+  double ay = a*sin_phi*cos_inc;
+  double bx = -b*sin_phi;
+  double by = b*cos_phi*cos_inc;
+
+  // Half-widths of ellipse after rotation by pa
+  double x_ext = sqrt(
+    pow(ax*cos_pa - ay*sin_pa, 2) + pow(bx*cos_pa - by*sin_pa, 2));
+  double y_ext = sqrt(
+    pow(ax*sin_pa + ay*cos_pa, 2) + pow(bx*sin_pa + by*cos_pa, 2));
+
+  // Convert to pixel indices with a one pixel margin, clamped to the image
+  Footprint fp;
+  fp.jmin = static_cast<int>(std::max(
+    0.0, floor((xc_sky - x_ext - x_min)/dx) - 1.0));
+  fp.jmax = static_cast<int>(std::min(
+    nj - 1.0, floor((xc_sky + x_ext - x_min)/dx) + 1.0));
+  fp.imin = static_cast<int>(std::max(
+    0.0, floor((yc_sky - y_ext - y_min)/dy) - 1.0));
+  fp.imax = static_cast<int>(std::min(
+    ni - 1.0, floor((yc_sky + y_ext - y_min)/dy) + 1.0));
+
+  return fp;
+}
+
 void DiscModel::calculate_rel_lambda() {
   /*
     Calculate relative lambda (ie. relative velocity) shift map.
   */
   double sin_inc = sin(inc);
+  const MapView out = rel_lambda.write();
 
-  for (size_t i=0; i<rel_lambda.size(); i++) {
-    for (size_t j=0; j<rel_lambda[i].size(); j++) {
+  for (size_t i=0; i<rel_lambda.get_ni(); i++) {
+    for (size_t j=0; j<rel_lambda.get_nj(); j++) {
       // Calc relative lambda
-      if (rad[i][j] == 0.0) {
-        rel_lambda[i][j] = 0.0;
+      if (rad(i, j) == 0.0) {
+        out(i, j) = 0.0;
       } else {
-        rel_lambda[i][j] = vmax*pow(1.0 + vslope/rad[i][j], vbeta);
-        rel_lambda[i][j] /= pow(
-          1.0 + pow(vslope/rad[i][j], vgamma), 1.0/vgamma);
-        rel_lambda[i][j] *= sin_inc*cos_angle[i][j];
+        out(i, j) = vmax*pow(1.0 + vslope/rad(i, j), vbeta);
+        out(i, j) /= pow(
+          1.0 + pow(vslope/rad(i, j), vgamma), 1.0/vgamma);
+        out(i, j) *= sin_inc*cos_angle(i, j);
       }
-      rel_lambda[i][j] += vsys;
-      rel_lambda[i][j] /= constants::C;
-      rel_lambda[i][j] += 1.0;
+      out(i, j) += vsys;
+      out(i, j) /= constants::C;
+      out(i, j) += 1.0;
     }
   }
 }
@@ -768,19 +1070,217 @@ void DiscModel::calculate_vdisp() {
   /*
     Calculate velocity dispersion map.
   */
-  for (size_t i=0; i<vdisp.size(); i++) {
-    for (size_t j=0; j<vdisp[i].size(); j++) {
-      vdisp[i][j] = vdisp_param[0];
+  const MapView out = vdisp.write();
+
+  for (size_t i=0; i<vdisp.get_ni(); i++) {
+    for (size_t j=0; j<vdisp.get_nj(); j++) {
+      out(i, j) = vdisp_param[0];
       for (int v=0; v<vdisp_order; v++)
-        vdisp[i][j] += vdisp_param[v+1]*pow(rad[i][j], v+1);
-      vdisp[i][j] = exp(vdisp[i][j])/constants::C;
+        out(i, j) += vdisp_param[v+1]*pow(rad(i, j), v+1);
+      out(i, j) = exp(out(i, j))/constants::C;
     }
   }
 }
 
+void DiscModel::accumulate_delta(double sign, CubeWorkspace& ws) const {
+  const size_t nr = preconvolved.get_nr();
+
+  for (size_t h=0; h<ws.dirty_spaxels.size(); h++) {
+    const double* spectrum = preconvolved.spectrum(ws.dirty_spaxels[h]);
+    double* delta_spec = &ws.delta_preconvolved[h*nr];
+    for (size_t r=0; r<nr; r++)
+      delta_spec[r] += sign*spectrum[r];
+  }
+}
+
+void DiscModel::calculate_noise_weights() {
+  /*
+    Weights for each distinct variance value. The log-normalisation of each
+    spectrum is then gathered by spaxel_log_norm.
+  */
+  const std::vector<double>& var_levels = context->get_var_levels();
+  const double sigma0sq = sigma0*sigma0;
+  // Every level but the excluded level 0, which stays zero, is rewritten
+  double* weights = noise_weight.discard().data();
+  double* log_vars = noise_log_var.discard().data();
+
+  ThreadPool::get_instance().parallel_for(
+    var_levels.size() - 1, level_chunk,
+    [&](int begin, int end) {
+      double var;
+      for (int k=begin+1; k<end+1; k++) {
+        var = var_levels[k] + sigma0sq;
+        weights[k] = 1.0/var;
+        log_vars[k] = log(var);
+      }
+    });
+
+  noise_sigma0 = sigma0;
+}
+
+double DiscModel::spaxel_log_norm(int h) const {
+  const int nr = context->get_nr();
+  const uint32_t* level = context->get_valid_level(h);
+  const double* log_vars = noise_log_var.read().data();
+
+  double log_var = 0.0;
+  for (int r=0; r<nr; r++)
+    log_var += log_vars[level[r]];
+
+  return context->get_valid_log_norm(h) - 0.5*log_var;
+}
+
+void DiscModel::calculate_log_likelihood() {
+  const int nv = context->get_nv();
+
+  const bool noise_changed = (sigma0 != noise_sigma0);
+  if (noise_changed)
+    calculate_noise_weights();
+
+  /*
+    Unique storage is taken before threads write to it. Every valid spaxel
+    is rewritten, so shared values are not copied.
+  */
+  double* res_sq = residual_sq.discard().data();
+  double* logL_values = logL_spaxel.discard().data();
+  double* norms = noise_changed ? log_norm.discard().data() : NULL;
+
+  // Spaxels are evaluated in parallel, then summed in a fixed order
+  ThreadPool::get_instance().parallel_for(
+    nv, spaxel_chunk,
+    [&](int begin, int end) {
+      for (int h=begin; h<end; h++) {
+        if (noise_changed)
+          norms[h] = spaxel_log_norm(h);
+        logL_values[h] = spaxel_log_likelihood(h, res_sq);
+      }
+    });
+
+  logL = CompensatedSum();
+  for (int h=0; h<nv; h++)
+    logL.add(logL_values[h]);
+}
+
+void DiscModel::calculate_noise_log_likelihood() {
+  /*
+    Calculate the log-likelihood after a change to the noise parameters only,
+    from the cached squared residuals. The normalisation and weighted sum of
+    each spectrum are formed in a single pass.
+  */
+  const int nv = context->get_nv();
+
+  calculate_noise_weights();
+  double* norms = log_norm.discard().data();
+  double* logL_values = logL_spaxel.discard().data();
+
+  ThreadPool::get_instance().parallel_for(
+    nv, spaxel_chunk,
+    [&](int begin, int end) {
+      for (int h=begin; h<end; h++) {
+        norms[h] = spaxel_log_norm(h);
+        logL_values[h] = norms[h] - 0.5*spaxel_chisq(h);
+      }
+    });
+
+  logL = CompensatedSum();
+  for (int h=0; h<nv; h++)
+    logL.add(logL_values[h]);
+}
+
+void DiscModel::update_log_likelihood(const std::vector<int>& spaxels) {
+  /*
+    Update the log-likelihood for a subset of convolved spaxels. The noise
+    weights are current, as sigma0 is not changed with the model cube.
+  */
+  const std::vector<int>& valid_index = context->get_valid_index();
+  double* res_sq = residual_sq.write().data();
+  double* logL_values = logL_spaxel.write().data();
+
+  int h;
+  double logL_new;
+  for (size_t s=0; s<spaxels.size(); s++) {
+    h = valid_index[spaxels[s]];
+    if (h < 0)
+      continue;
+
+    logL_new = spaxel_log_likelihood(h, res_sq);
+    logL.add(logL_new - logL_values[h]);
+    logL_values[h] = logL_new;
+  }
+}
+
+double DiscModel::spaxel_log_likelihood(int h, double* res_sq) const {
+  const Spaxel& spaxel = context->get_valid()[h];
+  const int nr = convolved.get_nr();
+  const double* data_spec = context->get_valid_data(h);
+  const double* model_spec = convolved.spectrum(spaxel.i, spaxel.j);
+  double* res_spec = res_sq + h*nr;
+
+  double res;
+  for (int r=0; r<nr; r++) {
+    res = data_spec[r] - model_spec[r];
+    res_spec[r] = res*res;
+  }
+
+  return log_norm.read()[h] - 0.5*spaxel_chisq(h);
+}
+
+double DiscModel::spaxel_chisq(int h) const {
+  /*
+    Weighted sum of squared residuals for valid spaxel h. Excluded voxels
+    have zero weight, so no branches are needed. Independent partial sums
+    let it vectorise.
+  */
+  const int nr = convolved.get_nr();
+  const uint32_t* level = context->get_valid_level(h);
+  const double* weights = noise_weight.read().data();
+  const double* res_sq = residual_sq.read().data() + h*nr;
+
+  double chisq[4] = {0.0, 0.0, 0.0, 0.0};
+  int r = 0;
+  for (; r+4<=nr; r+=4) {
+    for (int k=0; k<4; k++)
+      chisq[k] += weights[level[r+k]]*res_sq[r+k];
+  }
+  for (; r<nr; r++)
+    chisq[0] += weights[level[r]]*res_sq[r];
+
+  return (chisq[0] + chisq[1]) + (chisq[2] + chisq[3]);
+}
+
+void DiscModel::mark_dirty(const Footprint& fp, CubeWorkspace& ws) const {
+  const int nj = flux[0].get_nj();
+
+  int n;
+  for (int i=fp.imin; i<=fp.imax; i++) {
+    for (int j=fp.jmin; j<=fp.jmax; j++) {
+      n = i*nj + j;
+      if (!ws.dirty_mask[n]) {
+        ws.dirty_mask[n] = 1;
+        ws.dirty_spaxels.push_back(n);
+      }
+    }
+  }
+}
+
+void DiscModel::mark_all_dirty(CubeWorkspace& ws) const {
+  ws.dirty_spaxels.resize(ws.dirty_mask.size());
+  for (size_t n=0; n<ws.dirty_mask.size(); n++)
+    ws.dirty_spaxels[n] = n;
+  std::fill(ws.dirty_mask.begin(), ws.dirty_mask.end(), 1);
+}
+
+void DiscModel::clear_dirty(CubeWorkspace& ws) const {
+  if (ws.dirty_spaxels.size() == ws.dirty_mask.size()) {
+    std::fill(ws.dirty_mask.begin(), ws.dirty_mask.end(), 0);
+  } else {
+    for (size_t h=0; h<ws.dirty_spaxels.size(); h++)
+      ws.dirty_mask[ws.dirty_spaxels[h]] = 0;
+  }
+  ws.dirty_spaxels.clear();
+}
+
 void DiscModel::clear_flux_map() {
   for (size_t l=0; l<flux.size(); l++)
-    for (size_t i=0; i<flux[l].size(); i++)
-      for (size_t j=0; j<flux[l][i].size(); j++)
-        flux[l][i][j] = 0.0;
+    flux[l].fill(0.0);
 }
@@ -1,65 +1,177 @@
 #ifndef BLOBBY3D_DISCMODEL_H_
 #define BLOBBY3D_DISCMODEL_H_
 
+#include <cmath>
 #include <vector>
 
 #include "DNest4/code/DNest4.h"
 #include "BlobConditionalPrior.h"
 #include "Conv.h"
+#include "Cube.h"
 #include "Data.h"
+#include "ModelContext.h"
+#include "SampleWriter.h"
+
+/*
+  Inclusive range of spaxels that a blob can contribute flux to.
+*/
+struct Footprint {
+  int imin, imax;
+  int jmin, jmax;
+};
+
+/*
+  Double precision sum with Neumaier compensation for the rounding error.
+*/
+class CompensatedSum {
+  private:
+    double sum;
+    double compensation;
+
+  public:
+    CompensatedSum() : sum(0.0), compensation(0.0) {}
+
+    void add(double value) {
+      double t = sum + value;
+      if (std::abs(sum) >= std::abs(value))
+        compensation += (sum - t) + value;
+      else
+        compensation += (value - t) + sum;
+      sum = t;
+    }
+
+    double value() const { return sum + compensation; }
+};
+
+/*
+  Scratch arrays used while a model cube is calculated, which are empty or
+  zero again when the calculation ends. They are kept per thread, so copying
+  a model doesn't copy them.
+*/
+struct CubeWorkspace {
+  /*
+    Spaxels (flattened i*nj + j) whose spectra need to be reconstructed,
+    with a mask to avoid duplicates.
+  */
+  std::vector<int> dirty_spaxels;
+  std::vector<char> dirty_mask;
+
+  // Change in the preconvolved spectra of dirty spaxels
+  std::vector<double> delta_preconvolved;
+
+  // Wavelength slices of preconvolved containing flux
+  std::vector<char> active_slices;
+
+  // Convolved spaxels changed by an incremental update
+  std::vector<int> touched_spaxels;
+};
 
 class DiscModel {
   private:
     DNest4::RJObject<BlobConditionalPrior> blobs;
 
-    // TODO: Find elegant way to initialise constructor in DiscModel.cpp
-    Conv conv = Conv(
-      Data::get_instance().get_convolve(),
-      Data::get_instance().get_psf_amp(),
-      Data::get_instance().get_psf_fwhm(),
-      Data::get_instance().get_psf_beta(),
-      Data::get_instance().get_psf_sigma(),
-      Data::get_instance().get_psf_sigma_overdx(),
-      Data::get_instance().get_psf_sigma_overdy(),
-      Data::get_instance().get_ni(),
-      Data::get_instance().get_nj(),
-      Data::get_instance().get_nr(),
-      Data::get_instance().get_dx(),
-      Data::get_instance().get_dy(),
-      Data::get_instance().get_x_pad(),
-      Data::get_instance().get_y_pad()
-      ); // setup convolution kernels
+    // Data and derived quantities shared between all models
+    const ModelContext* context;
+
+    // Convolution by the PSF shared between all models
+    Conv conv;
+
     /*
       Arrays
     */
-    std::vector< std::vector< std::vector<double> > > preconvolved;
-    std::vector< std::vector< std::vector<double> > > imageos;
-    std::vector< std::vector< std::vector<double> > > convolved;
+    Cube preconvolved;
+    Cube imageos;
+    Cube convolved;
+
+    Map x_shft;
+    Map y_shft;
+    Map rad;
+    Map cos_angle;
+
+    std::vector<Map> flux;
+    Map rel_lambda;
+    Map vdisp;
+
+    // Workspace of the calling thread, kept for the life of the thread
+    static CubeWorkspace& thread_workspace();
+
+    void mark_dirty(const Footprint& fp, CubeWorkspace& ws) const;
+    void mark_all_dirty(CubeWorkspace& ws) const;
+    void clear_dirty(CubeWorkspace& ws) const;
+
+    // Add sign times the preconvolved spectra of dirty spaxels to the delta
+    void accumulate_delta(double sign, CubeWorkspace& ws) const;
+
+    /*
+      Wavelength bins [first, last) with non-zero flux for each line profile
+      (main and constrained lines) and spaxel, indexed profile*ni*nj + n.
+      Bins outside these windows are exactly zero in preconvolved.
+    */
+    int nprofiles;
+    SharedArray< std::vector<int> > window_first;
+    SharedArray< std::vector<int> > window_last;
+
+    void calculate_active_slices(CubeWorkspace& ws) const;
 
-    std::vector< std::vector<double> > x_shft;
-    std::vector< std::vector<double> > y_shft;
-    std::vector< std::vector<double> > rad;
-    std::vector< std::vector<double> > cos_angle;
+    // Log-likelihood for each valid spaxel and in total
+    SharedArray< std::vector<double> > logL_spaxel;
+    CompensatedSum logL;
+
+    /*
+      Weight 1/(var + sigma0^2) and log(var + sigma0^2) of each distinct
+      variance value (see ModelContext::get_var_levels), zero for the
+      excluded level 0, and the log-normalisation of each valid spectrum.
+      sigma0 shifts every variance by the same amount, so the logs and
+      divisions are done once per distinct value and gathered for each
+      voxel. These are recalculated when the sigma0 they were calculated for
+      changes.
+    */
+    SharedArray<AlignedVector> noise_weight;
+    SharedArray<AlignedVector> noise_log_var;
+    SharedArray< std::vector<double> > log_norm;
+    double noise_sigma0;
+    void calculate_noise_weights();
+    double spaxel_log_norm(int h) const;
 
-    std::vector< std::vector< std::vector<double> > > flux;
-    std::vector< std::vector<double> > rel_lambda;
-    std::vector< std::vector<double> > vdisp;
+    /*
+      Squared residuals (data - convolved)^2 of the packed valid voxels,
+      kept up to date with the convolved cube. The likelihood for a new
+      sigma0 is calculated from these without reading the model.
+    */
+    SharedArray<AlignedVector> residual_sq;
+
+    void calculate_log_likelihood();
+    void calculate_noise_log_likelihood();
+    void update_log_likelihood(const std::vector<int>& spaxels);
+    /*
+      Log-likelihood of valid spaxel h, updating its squared residuals in
+      res_sq, the unique storage of residual_sq.
+    */
+    double spaxel_log_likelihood(int h, double* res_sq) const;
+    double spaxel_chisq(int h) const;
 
-    void calculate_cube();
+    // Calculate cube, with components the blobs of the model
+    void calculate_cube(const std::vector< std::vector<double> >& components);
 
     // Construct cube from maps
     void calculate_shifted_arrays();
 
     void calculate_flux();
     void add_disc_flux();
-    void add_blob_flux(std::vector< std::vector<double> >& components);
+    void add_blob_flux(
+      const std::vector< std::vector<double> >& components, double sign,
+      CubeWorkspace& ws);
+    Footprint blob_footprint(const std::vector<double>& component) const;
 
     void calculate_vdisp();
     void calculate_rel_lambda();
-    void construct_cube();
+    void construct_cube(const CubeWorkspace& ws);
+    // Add a line to the spectra of spaxels[begin] to spaxels[end-1]
     void construct_line_cube(
-      double line, double factor,
-      std::vector< std::vector<double> >& flux_map);
+      double line, double factor, const Map& flux_map, int profile,
+      const std::vector<int>& spaxels, int begin, int end,
+      const CubeView& out, std::vector<int>& first, std::vector<int>& last)
+      const;
     void clear_cube();
     void clear_flux_map();
 
@@ -116,6 +228,23 @@ class DiscModel {
     bool blob_perturb;
     bool noise_perturb;
 
+    // Number of spaxels per chunk of work shared between threads
+    static const int spaxel_chunk = 16;
+
+    // Number of distinct variance values per chunk of noise weights
+    static const int level_chunk = 1024;
+
+    // Incremental blob updates since flux map was last rebuilt
+    int flux_updates;
+    static const int max_flux_updates = 100;
+
+    /*
+      Set by read, which restores the products but not the blobs RJObject.
+      Such a model can't be sampled or printed, see require_sampled.
+    */
+    bool products_only;
+    void require_sampled(const char* caller) const;
+
   public:
     DiscModel();
 
@@ -131,6 +260,21 @@ class DiscModel {
     // Print to stream
     void print(std::ostream& out) const;
 
+    // Write the maps and cubes selected by the writer as one record
+    void write_products(SampleWriter& writer) const;
+
+    /*
+      Set the parameters from a line written by print, skipping any maps and
+      cubes saved before them, and reconstruct the maps and cubes. Returns
+      false if the line doesn't match the model options.
+
+      The blobs are only used to build the products: DNest4 gives no way to
+      set the components of the RJObject, so it keeps its previous state.
+      The model is then for write_products only, and perturb,
+      log_likelihood and print exit with an error.
+    */
+    bool read(std::istream& in);
+
     // Return string with column information
     std::string description() const;
 };
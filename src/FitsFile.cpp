@@ -0,0 +1,402 @@
+#include "FitsFile.h"
+
+#include <iostream>
+#include <fstream>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+/*
+  Header and data location of a header data unit.
+*/
+struct Hdu {
+  std::map<std::string, std::string> cards;
+  int index;
+  int bitpix;
+  std::vector<int64_t> naxis;
+  std::streamoff data_offset;
+};
+
+std::string trim(const std::string& str) {
+  size_t first = str.find_first_not_of(' ');
+  if (first == std::string::npos)
+    return "";
+  size_t last = str.find_last_not_of(' ');
+  return str.substr(first, last - first + 1);
+}
+
+std::string lower(std::string str) {
+  std::transform(str.begin(), str.end(), str.begin(), ::tolower);
+  return str;
+}
+
+std::string upper(std::string str) {
+  std::transform(str.begin(), str.end(), str.begin(), ::toupper);
+  return str;
+}
+
+void split_filespec(
+    const std::string& filespec, std::string& path, std::string& selection) {
+  size_t open = filespec.rfind('[');
+  if (open != std::string::npos && filespec[filespec.size() - 1] == ']') {
+    path = filespec.substr(0, open);
+    selection = trim(filespec.substr(open + 1, filespec.size() - open - 2));
+  } else {
+    path = filespec;
+    selection.clear();
+  }
+}
+
+bool parse_card(const char* card, std::string& key, std::string& value) {
+  // Only keywords with a value indicator in columns 9-10 have values
+  key = trim(std::string(card, 8));
+  if (card[8] != '=' || card[9] != ' ')
+    return false;
+
+  std::string field(card + 10, FitsFile::card_size - 10);
+  size_t start = field.find_first_not_of(' ');
+  value.clear();
+  if (start == std::string::npos)
+    return true;
+
+  if (field[start] == '\'') {
+    // Quoted string where '' is an escaped quote
+    for (size_t k=start+1; k<field.size(); k++) {
+      if (field[k] == '\'') {
+        if (k + 1 < field.size() && field[k+1] == '\'') {
+          value += '\'';
+          k++;
+          continue;
+        }
+        break;
+      }
+      value += field[k];
+    }
+    value = trim(value);
+  } else {
+    size_t slash = field.find('/', start);
+    if (slash == std::string::npos)
+      value = trim(field.substr(start));
+    else
+      value = trim(field.substr(start, slash - start));
+  }
+
+  return true;
+}
+
+bool has_card(const Hdu& hdu, const std::string& key) {
+  return hdu.cards.find(key) != hdu.cards.end();
+}
+
+std::string string_card(
+    const Hdu& hdu, const std::string& key, const std::string& fallback) {
+  std::map<std::string, std::string>::const_iterator it = hdu.cards.find(key);
+  return (it == hdu.cards.end()) ? fallback : it->second;
+}
+
+double real_card(const Hdu& hdu, const std::string& key, double fallback) {
+  std::string value = string_card(hdu, key, "");
+  if (value.empty())
+    return fallback;
+
+  // Fortran style exponents are allowed
+  std::replace(value.begin(), value.end(), 'D', 'E');
+  std::replace(value.begin(), value.end(), 'd', 'e');
+  return strtod(value.c_str(), NULL);
+}
+
+int64_t integer_card(const Hdu& hdu, const std::string& key, int64_t fallback) {
+  std::string value = string_card(hdu, key, "");
+  if (value.empty())
+    return fallback;
+  return strtoll(value.c_str(), NULL, 10);
+}
+
+std::string axis_key(const std::string& key, int axis) {
+  return key + std::to_string(axis);
+}
+
+bool read_hdu(std::ifstream& fin, int index, Hdu& hdu) {
+  // Read header blocks up to the END card
+  hdu.cards.clear();
+  hdu.index = index;
+  char block[FitsFile::block_size];
+  std::string key, value;
+  bool end = false;
+  while (!end) {
+    if (!fin.read(block, FitsFile::block_size))
+      return false;
+
+    for (int c=0; c<FitsFile::block_size/FitsFile::card_size; c++) {
+      const char* card = block + c*FitsFile::card_size;
+      if (std::strncmp(card, "END     ", 8) == 0) {
+        end = true;
+        break;
+      }
+      if (parse_card(card, key, value) && !has_card(hdu, key))
+        hdu.cards[key] = value;
+    }
+  }
+
+  hdu.bitpix = integer_card(hdu, "BITPIX", 0);
+  hdu.naxis.assign(integer_card(hdu, "NAXIS", 0), 0);
+  for (size_t n=0; n<hdu.naxis.size(); n++)
+    hdu.naxis[n] = integer_card(hdu, axis_key("NAXIS", n + 1), 0);
+  hdu.data_offset = fin.tellg();
+
+  // Skip the data, which is padded to a whole number of blocks
+  int64_t size = 0;
+  if (!hdu.naxis.empty()) {
+    size = 1;
+    for (size_t n=0; n<hdu.naxis.size(); n++)
+      size *= hdu.naxis[n];
+  }
+  size += integer_card(hdu, "PCOUNT", 0);
+  size *= integer_card(hdu, "GCOUNT", 1)*std::abs(hdu.bitpix)/8;
+  size = ((size + FitsFile::block_size - 1)/FitsFile::block_size)
+    *FitsFile::block_size;
+  fin.seekg(size, std::ios::cur);
+
+  return true;
+}
+
+bool is_image_cube(const Hdu& hdu) {
+  if (hdu.index > 0 && upper(string_card(hdu, "XTENSION", "")) != "IMAGE")
+    return false;
+  if (hdu.naxis.size() != 3)
+    return false;
+  return hdu.naxis[0] > 0 && hdu.naxis[1] > 0 && hdu.naxis[2] > 0;
+}
+
+Hdu find_hdu(const std::string& filespec) {
+  std::string path, selection;
+  split_filespec(filespec, path, selection);
+
+  std::ifstream fin(path, std::ios::in | std::ios::binary);
+  if (!fin) {
+    std::cerr<<"# ERROR: couldn't open file "<<path<<"."<<std::endl;
+    exit(0);
+  }
+
+  // Select by HDU number if the selection is a number, otherwise by EXTNAME
+  char* end;
+  long number = strtol(selection.c_str(), &end, 10);
+  bool by_number = !selection.empty() && *end == '\0';
+
+  Hdu hdu;
+  for (int index=0; read_hdu(fin, index, hdu); index++) {
+    if (index == 0 && !has_card(hdu, "SIMPLE"))
+      break;
+
+    bool selected;
+    if (selection.empty())
+      selected = is_image_cube(hdu);
+    else if (by_number)
+      selected = (index == number);
+    else
+      selected = (upper(string_card(hdu, "EXTNAME", "")) == upper(selection));
+
+    if (selected) {
+      if (!is_image_cube(hdu)) {
+        std::cerr<<"# ERROR: HDU "<<index<<" of "<<path;
+        std::cerr<<" is not a 3D image."<<std::endl;
+        exit(0);
+      }
+      return hdu;
+    }
+  }
+
+  std::cerr<<"# ERROR: couldn't find a 3D image HDU in "<<filespec<<".";
+  std::cerr<<std::endl;
+  exit(0);
+}
+
+double axis_delta(const Hdu& hdu, int axis) {
+  // CDELT, or the diagonal of the CD matrix, in axis units per pixel
+  std::string cd = "CD" + std::to_string(axis) + "_" + std::to_string(axis);
+  if (has_card(hdu, axis_key("CDELT", axis)))
+    return real_card(hdu, axis_key("CDELT", axis), 1.0);
+  return real_card(hdu, cd, 1.0);
+}
+
+double spatial_scale(const Hdu& hdu, int axis) {
+  // Arcsec per axis unit, celestial axes default to degrees
+  std::string unit = lower(string_card(hdu, axis_key("CUNIT", axis), ""));
+  if (unit.empty()) {
+    std::string ctype = string_card(hdu, axis_key("CTYPE", axis), "");
+    return (ctype.size() > 4 && ctype[4] == '-') ? 3600.0 : 1.0;
+  }
+  if (unit == "deg")
+    return 3600.0;
+  if (unit == "arcmin")
+    return 60.0;
+  if (unit == "arcsec")
+    return 1.0;
+  if (unit == "mas")
+    return 1e-3;
+  if (unit == "rad")
+    return 180.0*3600.0/M_PI;
+
+  std::cerr<<"# WARNING: unknown spatial unit "<<unit;
+  std::cerr<<", assuming arcsec."<<std::endl;
+  return 1.0;
+}
+
+double spectral_scale(const Hdu& hdu) {
+  // Angstrom per axis unit, defaults to Angstrom
+  std::string unit = lower(string_card(hdu, "CUNIT3", ""));
+  if (unit.empty() || unit == "angstrom" || unit == "a")
+    return 1.0;
+  if (unit == "nm")
+    return 10.0;
+  if (unit == "um")
+    return 1e4;
+  if (unit == "m")
+    return 1e10;
+
+  std::cerr<<"# WARNING: unknown spectral unit "<<unit;
+  std::cerr<<", assuming Angstrom."<<std::endl;
+  return 1.0;
+}
+
+uint64_t load_be(const unsigned char* bytes, int size) {
+  uint64_t value = 0;
+  for (int b=0; b<size; b++)
+    value = (value << 8) | bytes[b];
+  return value;
+}
+
+}  // namespace
+
+bool FitsFile::is_fits(const std::string& filespec) {
+  std::string path, selection;
+  split_filespec(filespec, path, selection);
+
+  std::ifstream fin(path, std::ios::in | std::ios::binary);
+  char card[card_size];
+  if (!fin.read(card, card_size))
+    return false;
+
+  std::string key, value;
+  return parse_card(card, key, value) && key == "SIMPLE" && value == "T";
+}
+
+CubeHeader FitsFile::read_header(const std::string& filespec) {
+  Hdu hdu = find_hdu(filespec);
+
+  CubeHeader header;
+  header.version = CubeFile::version;
+  header.value_size = std::abs(hdu.bitpix)/8;
+  header.ni = hdu.naxis[1];
+  header.nj = hdu.naxis[0];
+  header.nr = hdu.naxis[2];
+
+  // Spatial axes centred on (0, 0)
+  double dx = std::abs(axis_delta(hdu, 1))*spatial_scale(hdu, 1);
+  double dy = std::abs(axis_delta(hdu, 2))*spatial_scale(hdu, 2);
+  header.x_min = -0.5*header.nj*dx;
+  header.x_max = 0.5*header.nj*dx;
+  header.y_min = -0.5*header.ni*dy;
+  header.y_max = 0.5*header.ni*dy;
+
+  // Wavelength edges, where pixel p is centred on CRVAL3 + (p - CRPIX3)*CDELT3
+  double scale = spectral_scale(hdu);
+  double dr = axis_delta(hdu, 3);
+  if (dr <= 0.0) {
+    std::cerr<<"# ERROR: wavelength must increase along axis 3 of ";
+    std::cerr<<filespec<<"."<<std::endl;
+    exit(0);
+  }
+  double crval = real_card(hdu, "CRVAL3", 0.0);
+  double crpix = real_card(hdu, "CRPIX3", 1.0);
+  header.r_min = (crval + (0.5 - crpix)*dr)*scale;
+  header.r_max = (crval + (header.nr + 0.5 - crpix)*dr)*scale;
+
+  return header;
+}
+
+Cube FitsFile::read(const std::string& filespec, int ni, int nj, int nr) {
+  Hdu hdu = find_hdu(filespec);
+  if (hdu.naxis[1] != ni || hdu.naxis[0] != nj || hdu.naxis[2] != nr) {
+    std::cerr<<"# ERROR: "<<filespec<<" has shape (";
+    std::cerr<<hdu.naxis[1]<<", "<<hdu.naxis[0]<<", "<<hdu.naxis[2];
+    std::cerr<<"), expected ("<<ni<<", "<<nj<<", "<<nr<<")."<<std::endl;
+    exit(0);
+  }
+
+  const int bitpix = hdu.bitpix;
+  const int value_size = std::abs(bitpix)/8;
+  if (bitpix != 8 && bitpix != 16 && bitpix != 32 && bitpix != 64
+      && bitpix != -32 && bitpix != -64) {
+    std::cerr<<"# ERROR: unsupported BITPIX "<<bitpix;
+    std::cerr<<" in "<<filespec<<"."<<std::endl;
+    exit(0);
+  }
+
+  const double bscale = real_card(hdu, "BSCALE", 1.0);
+  const double bzero = real_card(hdu, "BZERO", 0.0);
+  const bool has_blank = bitpix > 0 && has_card(hdu, "BLANK");
+  const int64_t blank = integer_card(hdu, "BLANK", 0);
+
+  std::string path, selection;
+  split_filespec(filespec, path, selection);
+  std::ifstream fin(path, std::ios::in | std::ios::binary);
+  fin.seekg(hdu.data_offset);
+
+  // Stream one wavelength plane, in (y, x) order, at a time
+  Cube cube(ni, nj, nr);
+  const CubeView out = cube.write();
+  std::vector<unsigned char> plane(static_cast<size_t>(ni)*nj*value_size);
+  for (int r=0; r<nr; r++) {
+    if (!fin.read(reinterpret_cast<char*>(plane.data()), plane.size())) {
+      std::cerr<<"# ERROR: "<<filespec<<" is truncated."<<std::endl;
+      exit(0);
+    }
+
+    const unsigned char* bytes = plane.data();
+    for (int i=0; i<ni; i++) {
+      for (int j=0; j<nj; j++) {
+        uint64_t bits = load_be(bytes, value_size);
+        bytes += value_size;
+
+        double value;
+        int64_t raw;
+        bool is_blank = false;
+        if (bitpix == -64) {
+          std::memcpy(&value, &bits, sizeof(value));
+        } else if (bitpix == -32) {
+          uint32_t bits32 = static_cast<uint32_t>(bits);
+          float value32;
+          std::memcpy(&value32, &bits32, sizeof(value32));
+          value = value32;
+        } else {
+          // Sign extend integers, BITPIX = 8 is unsigned
+          if (bitpix == 8)
+            raw = static_cast<int64_t>(bits);
+          else if (bitpix == 16)
+            raw = static_cast<int16_t>(bits);
+          else if (bitpix == 32)
+            raw = static_cast<int32_t>(bits);
+          else
+            raw = static_cast<int64_t>(bits);
+          is_blank = has_blank && raw == blank;
+          value = static_cast<double>(raw);
+        }
+
+        value = bzero + bscale*value;
+        if (is_blank || !std::isfinite(value))
+          value = std::numeric_limits<double>::quiet_NaN();
+        out(i, j, r) = value;
+      }
+    }
+  }
+
+  return cube;
+}
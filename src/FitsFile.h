@@ -0,0 +1,41 @@
+#ifndef BLOBBY3D_FITSFILE_H_
+#define BLOBBY3D_FITSFILE_H_
+
+#include <string>
+
+#include "Cube.h"
+#include "CubeFile.h"
+
+/*
+  Minimal reader for 3D FITS image HDUs.
+
+  Files are given as "cube.fits", "cube.fits[NAME]" or "cube.fits[n]", where
+  NAME matches EXTNAME and n is the HDU number (0 for the primary HDU).
+  Without a selection the first HDU holding a 3D image is read.
+
+  FITS axis 1 is x, axis 2 is y and axis 3 is wavelength. The image is
+  streamed one wavelength plane at a time and transposed into the Cube
+  layout. Blank and non-finite values are read as NaN, which Data::load
+  excludes from the likelihood.
+
+  The metadata is derived from the linear WCS keywords (CRVAL, CRPIX and
+  CDELT or CD). Spatial axes are converted to arcsec and centred on (0, 0),
+  while the wavelength axis is converted to Angstrom.
+*/
+class FitsFile
+{
+ public:
+  static const int block_size = 2880;
+  static const int card_size = 80;
+
+  // True if the file exists and starts with a FITS primary header
+  static bool is_fits(const std::string& filespec);
+
+  // Metadata of the selected HDU, exits on malformed input
+  static CubeHeader read_header(const std::string& filespec);
+
+  // Read the selected HDU, which must have shape (ni, nj, nr)
+  static Cube read(const std::string& filespec, int ni, int nj, int nr);
+};
+
+#endif  // BLOBBY3D_FITSFILE_H_
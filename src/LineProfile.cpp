@@ -0,0 +1,241 @@
+#include "LineProfile.h"
+
+#include <algorithm>
+
+#include "LookupErf.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BLOBBY3D_X86_DISPATCH
+#endif
+
+namespace {
+
+// Number of bin edges evaluated per chunk
+const int chunk = 256;
+
+// Position of x in units of the table spacing, as used by LookupTable
+inline double table_position(double x, double x_min, double one_over_dx) {
+  return (x - x_min)*one_over_dx;
+}
+
+void cdf_scalar(
+    const double* edges, int n, double lambda, double inv_width,
+    double* cdf) {
+  const LookupErf::Table& erf_table = LookupErf::get_table();
+
+  for (int k=0; k<n; k++)
+    cdf[k] = erf_table.evaluate((edges[k] - lambda)*inv_width);
+}
+
+#ifdef BLOBBY3D_X86_DISPATCH
+// GCC warns about the undefined placeholder vectors used inside intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+// No fused multiply-add, so the results match the scalar kernel
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+__attribute__((target("avx2")))
+void cdf_avx2(
+    const double* edges, int n, double lambda, double inv_width,
+    double* cdf) {
+  const LookupErf::Table& erf_table = LookupErf::get_table();
+  const double* table = erf_table.data();
+  const int num = erf_table.size();
+  const double x_min = erf_table.get_x_min();
+  const double one_over_dx = erf_table.get_one_over_dx();
+
+  const __m256d vlambda = _mm256_set1_pd(lambda);
+  const __m256d vinv_width = _mm256_set1_pd(inv_width);
+  const __m256d vx_min = _mm256_set1_pd(x_min);
+  const __m256d vone_over_dx = _mm256_set1_pd(one_over_dx);
+  const __m256d vlow = _mm256_set1_pd(-1.0);
+  const __m256d vbelow = _mm256_set1_pd(erf_table.get_below());
+  const __m256d vabove = _mm256_set1_pd(erf_table.get_above());
+  const __m256d vnum = _mm256_set1_pd(num);
+  const __m256d vlast = _mm256_set1_pd(num - 1);
+  const __m256d vone = _mm256_set1_pd(1.0);
+  const __m128i izero = _mm_setzero_si128();
+  const __m128i ilast = _mm_set1_epi32(num - 2);
+
+  int k = 0;
+  for (; k+4<=n; k+=4) {
+    __m256d x = _mm256_mul_pd(
+      _mm256_sub_pd(_mm256_loadu_pd(edges + k), vlambda), vinv_width);
+    __m256d t = _mm256_mul_pd(_mm256_sub_pd(x, vx_min), vone_over_dx);
+    t = _mm256_min_pd(_mm256_max_pd(t, vlow), vnum);
+
+    __m128i i = _mm256_cvttpd_epi32(t);
+    __m256d ti = _mm256_cvtepi32_pd(i);
+    __m256d frac = _mm256_sub_pd(t, ti);
+
+    // Gather neighbouring table values for in-range indices
+    __m128i ic = _mm_min_epi32(_mm_max_epi32(i, izero), ilast);
+    __m256d t0 = _mm256_i32gather_pd(table, ic, 8);
+    __m256d t1 = _mm256_i32gather_pd(table + 1, ic, 8);
+    __m256d value = _mm256_add_pd(
+      _mm256_mul_pd(frac, t1),
+      _mm256_mul_pd(_mm256_sub_pd(vone, frac), t0));
+
+    // Saturate outside the table
+    value = _mm256_blendv_pd(
+      value, vabove, _mm256_cmp_pd(ti, vlast, _CMP_GE_OQ));
+    value = _mm256_blendv_pd(
+      value, vbelow, _mm256_cmp_pd(t, vlow, _CMP_LE_OQ));
+
+    _mm256_storeu_pd(cdf + k, value);
+  }
+
+  for (; k<n; k++)
+    cdf[k] = erf_table.evaluate((edges[k] - lambda)*inv_width);
+}
+
+__attribute__((target("avx512f")))
+void cdf_avx512(
+    const double* edges, int n, double lambda, double inv_width,
+    double* cdf) {
+  const LookupErf::Table& erf_table = LookupErf::get_table();
+  const double* table = erf_table.data();
+  const int num = erf_table.size();
+  const double x_min = erf_table.get_x_min();
+  const double one_over_dx = erf_table.get_one_over_dx();
+
+  const __m512d vlambda = _mm512_set1_pd(lambda);
+  const __m512d vinv_width = _mm512_set1_pd(inv_width);
+  const __m512d vx_min = _mm512_set1_pd(x_min);
+  const __m512d vone_over_dx = _mm512_set1_pd(one_over_dx);
+  const __m512d vlow = _mm512_set1_pd(-1.0);
+  const __m512d vbelow = _mm512_set1_pd(erf_table.get_below());
+  const __m512d vabove = _mm512_set1_pd(erf_table.get_above());
+  const __m512d vnum = _mm512_set1_pd(num);
+  const __m512d vlast = _mm512_set1_pd(num - 1);
+  const __m512d vone = _mm512_set1_pd(1.0);
+  const __m256i izero = _mm256_setzero_si256();
+  const __m256i ilast = _mm256_set1_epi32(num - 2);
+
+  int k = 0;
+  for (; k+8<=n; k+=8) {
+    __m512d x = _mm512_mul_pd(
+      _mm512_sub_pd(_mm512_loadu_pd(edges + k), vlambda), vinv_width);
+    __m512d t = _mm512_mul_pd(_mm512_sub_pd(x, vx_min), vone_over_dx);
+    t = _mm512_min_pd(_mm512_max_pd(t, vlow), vnum);
+
+    __m256i i = _mm512_cvttpd_epi32(t);
+    __m512d ti = _mm512_cvtepi32_pd(i);
+    __m512d frac = _mm512_sub_pd(t, ti);
+
+    // Gather neighbouring table values for in-range indices
+    __m256i ic = _mm256_min_epi32(_mm256_max_epi32(i, izero), ilast);
+    __m512d t0 = _mm512_i32gather_pd(ic, table, 8);
+    __m512d t1 = _mm512_i32gather_pd(ic, table + 1, 8);
+    __m512d value = _mm512_add_pd(
+      _mm512_mul_pd(frac, t1),
+      _mm512_mul_pd(_mm512_sub_pd(vone, frac), t0));
+
+    // Saturate outside the table
+    value = _mm512_mask_blend_pd(
+      _mm512_cmp_pd_mask(ti, vlast, _CMP_GE_OQ), value, vabove);
+    value = _mm512_mask_blend_pd(
+      _mm512_cmp_pd_mask(t, vlow, _CMP_LE_OQ), value, vbelow);
+
+    _mm512_storeu_pd(cdf + k, value);
+  }
+
+  for (; k<n; k++)
+    cdf[k] = erf_table.evaluate((edges[k] - lambda)*inv_width);
+}
+
+#pragma GCC pop_options
+#pragma GCC diagnostic pop
+#endif
+
+}  // namespace
+
+const char* LineProfile::instruction_set = "scalar";
+LineProfile::CdfFunction LineProfile::cdf_function =
+  LineProfile::select_cdf_function();
+
+LineProfile::CdfFunction LineProfile::select_cdf_function() {
+#ifdef BLOBBY3D_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    instruction_set = "avx512f";
+    return cdf_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    instruction_set = "avx2";
+    return cdf_avx2;
+  }
+#endif
+  instruction_set = "scalar";
+  return cdf_scalar;
+}
+
+void LineProfile::window(
+    const double* edges, int nr, double lambda, double inv_width,
+    int& first, int& last) {
+  /*
+    The lookup saturates at -1 for table positions t <= -1 and at +1 for
+    t >= num - 1, so bins with both edges in the same saturated region
+    receive exactly zero flux. Edges are sorted, so the boundaries of the
+    saturated regions are found by bisection using the same arithmetic as
+    the CDF kernels.
+  */
+  const LookupErf::Table& erf_table = LookupErf::get_table();
+  const int num = erf_table.size();
+  const double x_min = erf_table.get_x_min();
+  const double one_over_dx = erf_table.get_one_over_dx();
+
+  const double* lower = std::partition_point(
+    edges, edges + nr + 1,
+    [&](double edge) {
+      return table_position(
+        (edge - lambda)*inv_width, x_min, one_over_dx) <= -1.0;
+    });
+  const double* upper = std::partition_point(
+    lower, edges + nr + 1,
+    [&](double edge) {
+      return table_position(
+        (edge - lambda)*inv_width, x_min, one_over_dx) < num - 1;
+    });
+
+  // Last edge saturated at -1 through to the first edge saturated at +1
+  first = std::max(static_cast<int>(lower - edges) - 1, 0);
+  last = std::min(static_cast<int>(upper - edges), nr);
+}
+
+void LineProfile::add(
+    const double* edges, int nr,
+    double lambda, double inv_width, double flux,
+    double* spectrum) {
+  int first, last;
+  window(edges, nr, lambda, inv_width, first, last);
+  add(edges, first, last, lambda, inv_width, flux, spectrum);
+}
+
+void LineProfile::add(
+    const double* edges, int first, int last,
+    double lambda, double inv_width, double flux,
+    double* spectrum) {
+  /*
+    The CDF is evaluated for a chunk of edges at a time, then differenced to
+    get the flux in each bin. Only bins within the window of the line are
+    touched.
+  */
+  const double amp = 0.5*flux;
+  double cdf[chunk + 1];
+
+  int n;
+  for (int start=first; start<last; start+=chunk) {
+    n = std::min(chunk, last - start);
+    cdf_function(edges + start, n + 1, lambda, inv_width, cdf);
+    for (int r=0; r<n; r++)
+      spectrum[start + r] += amp*(cdf[r+1] - cdf[r]);
+  }
+}
+
+const char* LineProfile::get_instruction_set() {
+  return instruction_set;
+}
@@ -0,0 +1,51 @@
+#ifndef BLOBBY3D_LINEPROFILE_H_
+#define BLOBBY3D_LINEPROFILE_H_
+
+/*
+  Gaussian line profiles integrated over wavelength bins.
+
+  The Gaussian CDF is evaluated at the bin edges of a whole spectrum at once
+  using the LookupErf table. The implementation (AVX-512, AVX2 or scalar) is
+  chosen at runtime from the instruction sets supported by the CPU. All
+  implementations give identical results.
+*/
+class LineProfile {
+ private:
+  typedef void (*CdfFunction)(
+    const double* edges, int n, double lambda, double inv_width, double* cdf);
+
+  static CdfFunction cdf_function;
+  static const char* instruction_set;
+  static CdfFunction select_cdf_function();
+
+ public:
+  /*
+    Range of bins [first, last) that receive non-zero flux from a line with
+    centre lambda and inv_width = 1/sqrt(2*sigma^2). edges holds the nr + 1
+    bin edges in increasing order.
+  */
+  static void window(
+    const double* edges, int nr, double lambda, double inv_width,
+    int& first, int& last);
+
+  /*
+    Add a line with total flux, centre lambda and
+    inv_width = 1/sqrt(2*sigma^2) to spectrum. edges holds the nr + 1 bin
+    edges of the spectrum.
+  */
+  static void add(
+    const double* edges, int nr,
+    double lambda, double inv_width, double flux,
+    double* spectrum);
+
+  // As above, for bins [first, last) previously found by window
+  static void add(
+    const double* edges, int first, int last,
+    double lambda, double inv_width, double flux,
+    double* spectrum);
+
+  // Name of the instruction set used
+  static const char* get_instruction_set();
+};
+
+#endif  // BLOBBY3D_LINEPROFILE_H_
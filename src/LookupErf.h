@@ -1,7 +1,7 @@
 #ifndef BLOBBY3D_LOOKUPERF_H_
 #define BLOBBY3D_LOOKUPERF_H_
 
-#include <vector>
+#include "LookupTable.h"
 
 /*
 * Lookup tables for speeding things up
@@ -9,10 +9,11 @@
 */
 
 class LookupErf {
+  public:
+    typedef LookupTable<4001> Table;
+
   private:
-    int num;
-    double xMin, xMax, dx, one_over_dx;
-    std::vector<double> _erf; // exp(-x) for x >= 0
+    Table table; // erf(x) for -4 <= x <= 4
 
     LookupErf();
     LookupErf(const LookupErf& other);
@@ -20,8 +21,11 @@ class LookupErf {
     static LookupErf instance;
 
   public:
-    static double evaluate(double x);
+    static double evaluate(double x) { return instance.table.evaluate(x); }
+    static void evaluate(const double* x, int n, double* result)
+    { instance.table.evaluate(x, n, result); }
+
+    static const Table& get_table() { return instance.table; }
 };
 
 #endif  // BLOBBY3D_LOOKUPERF_H_
-
@@ -1,17 +1,18 @@
 #ifndef BLOBBY3D_LOOKUPEXP_H_
 #define BLOBBY3D_LOOKUPEXP_H_
 
-#include <vector>
+#include "LookupTable.h"
 
 /*
 * Lookup tables for speeding things up
 * Singleton pattern
 */
 class LookupExp {
+  public:
+    typedef LookupTable<1251> Table;
+
   private:
-    int num;
-    double xMin, xMax, dx, one_over_dx;
-    std::vector<double> _exp; // exp(-x) for x >= 0
+    Table table; // exp(-x) for x >= 0
 
     LookupExp();
     LookupExp(const LookupExp& other);
@@ -19,8 +20,11 @@ class LookupExp {
     static LookupExp instance;
 
     public:
-      static double evaluate(double x);
+      static double evaluate(double x) { return instance.table.evaluate(x); }
+      static void evaluate(const double* x, int n, double* result)
+      { instance.table.evaluate(x, n, result); }
+
+      static const Table& get_table() { return instance.table; }
 };
 
 #endif  // BLOBBY3D_LOOKUPEXP_H_
-
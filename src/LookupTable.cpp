@@ -0,0 +1,164 @@
+#include "LookupTable.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BLOBBY3D_X86_DISPATCH
+#endif
+
+namespace {
+
+// Interpolate one argument, as in LookupTable::evaluate
+inline double evaluate_one(const LookupBatch::Table& table, double x) {
+  const int num = table.size;
+
+  double t = (x - table.x_min)*table.one_over_dx;
+  t = std::min(std::max(t, -1.0), static_cast<double>(num));
+  int i = static_cast<int>(t);
+  int ic = std::min(std::max(i, 0), num - 2);
+
+  double frac = t - i;
+  double value = frac*table.values[ic+1] + (1.0 - frac)*table.values[ic];
+  value = (i >= num - 1) ? table.above : value;
+  return (t <= -1.0) ? table.below : value;
+}
+
+void evaluate_scalar(
+    const LookupBatch::Table& table, const double* x, int n, double* result) {
+  for (int k=0; k<n; k++)
+    result[k] = evaluate_one(table, x[k]);
+}
+
+#ifdef BLOBBY3D_X86_DISPATCH
+// GCC warns about the undefined placeholder vectors used inside intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+
+// No fused multiply-add, so the results match the scalar kernel
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+
+__attribute__((target("avx2")))
+void evaluate_avx2(
+    const LookupBatch::Table& table, const double* x, int n, double* result) {
+  const double* values = table.values;
+  const int num = table.size;
+
+  const __m256d vx_min = _mm256_set1_pd(table.x_min);
+  const __m256d vone_over_dx = _mm256_set1_pd(table.one_over_dx);
+  const __m256d vlow = _mm256_set1_pd(-1.0);
+  const __m256d vbelow = _mm256_set1_pd(table.below);
+  const __m256d vabove = _mm256_set1_pd(table.above);
+  const __m256d vnum = _mm256_set1_pd(num);
+  const __m256d vlast = _mm256_set1_pd(num - 1);
+  const __m256d vone = _mm256_set1_pd(1.0);
+  const __m128i izero = _mm_setzero_si128();
+  const __m128i ilast = _mm_set1_epi32(num - 2);
+
+  int k = 0;
+  for (; k+4<=n; k+=4) {
+    __m256d t = _mm256_mul_pd(
+      _mm256_sub_pd(_mm256_loadu_pd(x + k), vx_min), vone_over_dx);
+    t = _mm256_min_pd(_mm256_max_pd(t, vlow), vnum);
+
+    __m128i i = _mm256_cvttpd_epi32(t);
+    __m256d ti = _mm256_cvtepi32_pd(i);
+    __m256d frac = _mm256_sub_pd(t, ti);
+
+    // Gather neighbouring table values for in-range indices
+    __m128i ic = _mm_min_epi32(_mm_max_epi32(i, izero), ilast);
+    __m256d t0 = _mm256_i32gather_pd(values, ic, 8);
+    __m256d t1 = _mm256_i32gather_pd(values + 1, ic, 8);
+    __m256d value = _mm256_add_pd(
+      _mm256_mul_pd(frac, t1),
+      _mm256_mul_pd(_mm256_sub_pd(vone, frac), t0));
+
+    // Saturate outside the table
+    value = _mm256_blendv_pd(
+      value, vabove, _mm256_cmp_pd(ti, vlast, _CMP_GE_OQ));
+    value = _mm256_blendv_pd(
+      value, vbelow, _mm256_cmp_pd(t, vlow, _CMP_LE_OQ));
+
+    _mm256_storeu_pd(result + k, value);
+  }
+
+  for (; k<n; k++)
+    result[k] = evaluate_one(table, x[k]);
+}
+
+__attribute__((target("avx512f")))
+void evaluate_avx512(
+    const LookupBatch::Table& table, const double* x, int n, double* result) {
+  const double* values = table.values;
+  const int num = table.size;
+
+  const __m512d vx_min = _mm512_set1_pd(table.x_min);
+  const __m512d vone_over_dx = _mm512_set1_pd(table.one_over_dx);
+  const __m512d vlow = _mm512_set1_pd(-1.0);
+  const __m512d vbelow = _mm512_set1_pd(table.below);
+  const __m512d vabove = _mm512_set1_pd(table.above);
+  const __m512d vnum = _mm512_set1_pd(num);
+  const __m512d vlast = _mm512_set1_pd(num - 1);
+  const __m512d vone = _mm512_set1_pd(1.0);
+  const __m256i izero = _mm256_setzero_si256();
+  const __m256i ilast = _mm256_set1_epi32(num - 2);
+
+  int k = 0;
+  for (; k+8<=n; k+=8) {
+    __m512d t = _mm512_mul_pd(
+      _mm512_sub_pd(_mm512_loadu_pd(x + k), vx_min), vone_over_dx);
+    t = _mm512_min_pd(_mm512_max_pd(t, vlow), vnum);
+
+    __m256i i = _mm512_cvttpd_epi32(t);
+    __m512d ti = _mm512_cvtepi32_pd(i);
+    __m512d frac = _mm512_sub_pd(t, ti);
+
+    // Gather neighbouring table values for in-range indices
+    __m256i ic = _mm256_min_epi32(_mm256_max_epi32(i, izero), ilast);
+    __m512d t0 = _mm512_i32gather_pd(ic, values, 8);
+    __m512d t1 = _mm512_i32gather_pd(ic, values + 1, 8);
+    __m512d value = _mm512_add_pd(
+      _mm512_mul_pd(frac, t1),
+      _mm512_mul_pd(_mm512_sub_pd(vone, frac), t0));
+
+    // Saturate outside the table
+    value = _mm512_mask_blend_pd(
+      _mm512_cmp_pd_mask(ti, vlast, _CMP_GE_OQ), value, vabove);
+    value = _mm512_mask_blend_pd(
+      _mm512_cmp_pd_mask(t, vlow, _CMP_LE_OQ), value, vbelow);
+
+    _mm512_storeu_pd(result + k, value);
+  }
+
+  for (; k<n; k++)
+    result[k] = evaluate_one(table, x[k]);
+}
+
+#pragma GCC pop_options
+#pragma GCC diagnostic pop
+#endif
+
+}  // namespace
+
+const char* LookupBatch::instruction_set = "scalar";
+LookupBatch::Function LookupBatch::function =
+  LookupBatch::select_function();
+
+LookupBatch::Function LookupBatch::select_function() {
+#ifdef BLOBBY3D_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    instruction_set = "avx512f";
+    return evaluate_avx512;
+  } else if (__builtin_cpu_supports("avx2")) {
+    instruction_set = "avx2";
+    return evaluate_avx2;
+  }
+#endif
+  instruction_set = "scalar";
+  return evaluate_scalar;
+}
+
+const char* LookupBatch::get_instruction_set() {
+  return instruction_set;
+}
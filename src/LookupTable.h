@@ -0,0 +1,116 @@
+#ifndef BLOBBY3D_LOOKUPTABLE_H_
+#define BLOBBY3D_LOOKUPTABLE_H_
+
+#include <algorithm>
+#include <cmath>
+
+/*
+  Batch interpolation shared by tables of every size. The implementation
+  (AVX-512, AVX2 or scalar) is chosen at runtime from the instruction sets
+  supported by the CPU, and gathers the table values for a vector of
+  arguments at once. All implementations give identical results, equal to
+  LookupTable::evaluate.
+*/
+class LookupBatch {
+ public:
+  // Table passed to the kernels
+  struct Table {
+    const double* values;
+    int size;
+    double x_min, one_over_dx;
+    double below, above;
+  };
+
+ private:
+  typedef void (*Function)(
+    const Table& table, const double* x, int n, double* result);
+
+  static Function function;
+  static const char* instruction_set;
+  static Function select_function();
+
+ public:
+  // Evaluate n arguments, result may be x
+  static void evaluate(
+      const Table& table, const double* x, int n, double* result)
+  { function(table, x, n, result); }
+
+  // Name of the instruction set used
+  static const char* get_instruction_set();
+};
+
+/*
+  Table of a function over [x_min, x_max] with N evenly spaced points,
+  evaluated by linear interpolation. Arguments more than one spacing below
+  the table evaluate to below, and arguments at or past the last interval
+  evaluate to above.
+
+  The size is fixed at compile time so each use can choose its own
+  resolution. The largest interpolation error found when the table is built
+  is available from get_max_error.
+
+  Indices are clamped and the result selected without branches. Batches of
+  arguments are evaluated by LookupBatch.
+*/
+template <int N>
+class LookupTable {
+ private:
+  double x_min, x_max, dx, one_over_dx;
+  double below, above;
+  double max_error;
+  alignas(64) double values[N];
+
+ public:
+  template <typename Function>
+  LookupTable(
+      Function f, double x_min, double x_max, double below, double above)
+      :x_min(x_min)
+      ,x_max(x_max)
+      ,dx((x_max - x_min)/(N - 1))
+      ,one_over_dx(1.0/dx)
+      ,below(below)
+      ,above(above)
+      ,max_error(0.0) {
+    for (int i=0; i<N; i++)
+      values[i] = f(x_min + i*dx);
+
+    // Measure interpolation error between the table points
+    double x;
+    for (int i=0; i<N-1; i++) {
+      for (int s=1; s<4; s++) {
+        x = x_min + (i + 0.25*s)*dx;
+        max_error = std::max(max_error, std::abs(f(x) - evaluate(x)));
+      }
+    }
+  }
+
+  double evaluate(double x) const {
+    double t = (x - x_min)*one_over_dx;
+    t = std::min(std::max(t, -1.0), static_cast<double>(N));
+    int i = static_cast<int>(t);
+    int ic = std::min(std::max(i, 0), N - 2);
+
+    double frac = t - i;
+    double value = frac*values[ic+1] + (1.0 - frac)*values[ic];
+    value = (i >= N - 1) ? above : value;
+    return (t <= -1.0) ? below : value;
+  }
+
+  // Evaluate n arguments at once, result may be x
+  void evaluate(const double* x, int n, double* result) const {
+    const LookupBatch::Table table =
+      {values, N, x_min, one_over_dx, below, above};
+    LookupBatch::evaluate(table, x, n, result);
+  }
+
+  const double* data() const { return values; }
+  int size() const { return N; }
+  double get_x_min() const { return x_min; }
+  double get_x_max() const { return x_max; }
+  double get_one_over_dx() const { return one_over_dx; }
+  double get_below() const { return below; }
+  double get_above() const { return above; }
+  double get_max_error() const { return max_error; }
+};
+
+#endif  // BLOBBY3D_LOOKUPTABLE_H_
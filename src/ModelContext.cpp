@@ -0,0 +1,76 @@
+#include "ModelContext.h"
+
+#include <cmath>
+
+#include "SampleWriter.h"
+
+ModelContext::ModelContext(const Data& data)
+  :data(data)
+  ,ni(data.get_ni())
+  ,nj(data.get_nj())
+  ,nr(data.get_nr())
+  ,nv(data.get_nv())
+  ,x_pad(data.get_x_pad())
+  ,y_pad(data.get_y_pad())
+  ,x_min(data.get_x_min())
+  ,y_min(data.get_y_min())
+  ,dx(data.get_dx())
+  ,dy(data.get_dy())
+  ,x_pad_dx(data.get_x_pad_dx())
+  ,y_pad_dy(data.get_y_pad_dy())
+  ,pixel_width(data.get_pixel_width())
+  ,sigma_cutoff(data.get_sigma_cutoff())
+  ,lsf_sigmasq(pow(data.get_lsf_sigma(), 2))
+  ,psf_amp(data.get_psf_amp())
+  ,psf_fwhm(data.get_psf_fwhm())
+  ,psf_sigma(data.get_psf_sigma())
+  ,psf_sigma_overdx(data.get_psf_sigma_overdx())
+  ,psf_sigma_overdy(data.get_psf_sigma_overdy())
+  ,sample_value_size(data.get_sample_value_size()) {
+  /*
+    Flatten the emission lines. Each line is given as the main line
+    wavelength followed by (wavelength, flux ratio) pairs of constrained
+    lines.
+  */
+  const std::vector< std::vector<double> >& em_line = data.get_em_line();
+  nlines = em_line.size();
+
+  LineProfileSpec profile;
+  for (int l=0; l<nlines; l++) {
+    profile.wavelength = em_line[l][0];
+    profile.factor = 1.0;
+    profile.flux_map = l;
+    profiles.push_back(profile);
+
+    for (size_t ll=0; ll<(em_line[l].size()-1)/2; ll++) {
+      profile.wavelength = em_line[l][1+2*ll];
+      profile.factor = em_line[l][2+2*ll];
+      profiles.push_back(profile);
+    }
+  }
+
+  save_products = 0;
+  if (data.get_save_maps())
+    save_products |= SampleWriter::save_maps;
+  if (data.get_save_preconvolved())
+    save_products |= SampleWriter::save_preconvolved;
+  if (data.get_save_convolved())
+    save_products |= SampleWriter::save_convolved;
+
+  /*
+    Parameters are saved at full precision unless the products are saved
+    with them as text, so the products can be reconstructed exactly.
+  */
+  sample_precision = 6;
+  if (data.get_sample_parameters_only()) {
+    save_products = 0;
+    sample_precision = std::numeric_limits<double>::max_digits10;
+  } else if (sample_value_size > 0) {
+    sample_precision = std::numeric_limits<double>::max_digits10;
+  }
+}
+
+const ModelContext& ModelContext::get_instance() {
+  static const ModelContext instance(Data::get_instance());
+  return instance;
+}
@@ -0,0 +1,136 @@
+#ifndef BLOBBY3D_MODELCONTEXT_H_
+#define BLOBBY3D_MODELCONTEXT_H_
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "Cube.h"
+#include "Data.h"
+
+/*
+  A line profile in the model: a main line, or a line constrained to a main
+  line with a fixed flux ratio, taking its flux from the map of that main
+  line.
+*/
+struct LineProfileSpec {
+  double wavelength;
+  double factor;
+  int flux_map;
+};
+
+/*
+  Everything the model needs from Data, frozen once the data is loaded.
+  Scalars are copied, the emission lines are flattened into line profiles,
+  and arrays are referenced from Data without copying. Getters return by
+  value only for scalars, so the context can be read from hot loops without
+  allocating.
+*/
+class ModelContext {
+ private:
+  ModelContext(const ModelContext& other);
+  ModelContext& operator=(const ModelContext& other);
+
+  const Data& data;
+
+  // Shape
+  int ni, nj, nr;
+  int nv;
+  int x_pad, y_pad;
+
+  // Coordinates and widths
+  double x_min, y_min;
+  double dx, dy;
+  double x_pad_dx, y_pad_dy;
+  double pixel_width;
+
+  // Blob truncation
+  double sigma_cutoff;
+
+  // Line spread function variance
+  double lsf_sigmasq;
+
+  // PSF, which Data returns by value
+  std::vector<double> psf_amp;
+  std::vector<double> psf_fwhm;
+  std::vector<double> psf_sigma;
+  std::vector<double> psf_sigma_overdx, psf_sigma_overdy;
+
+  // Emission lines
+  int nlines;
+  std::vector<LineProfileSpec> profiles;
+
+  // Sample output
+  uint32_t save_products;
+  int sample_value_size;
+  int sample_precision;
+
+  explicit ModelContext(const Data& data);
+
+ public:
+  int get_ni() const { return ni; }
+  int get_nj() const { return nj; }
+  int get_nr() const { return nr; }
+  int get_nv() const { return nv; }
+  int get_x_pad() const { return x_pad; }
+  int get_y_pad() const { return y_pad; }
+  double get_x_min() const { return x_min; }
+  double get_y_min() const { return y_min; }
+  double get_dx() const { return dx; }
+  double get_dy() const { return dy; }
+  double get_x_pad_dx() const { return x_pad_dx; }
+  double get_y_pad_dy() const { return y_pad_dy; }
+  double get_pixel_width() const { return pixel_width; }
+  double get_sigma_cutoff() const { return sigma_cutoff; }
+  double get_lsf_sigmasq() const { return lsf_sigmasq; }
+
+  // Main lines, each with its own flux map
+  int get_nlines() const { return nlines; }
+
+  // Main and constrained line profiles, in the order they are modelled
+  const std::vector<LineProfileSpec>& get_profiles() const
+  { return profiles; }
+
+  // Products saved with each sample, as SampleWriter flags
+  uint32_t get_save_products() const { return save_products; }
+
+  // Bytes per binary sample value, 0 if samples are saved as text
+  int get_sample_value_size() const { return sample_value_size; }
+
+  // Significant digits of the saved parameters
+  int get_sample_precision() const { return sample_precision; }
+
+  // Grids
+  const Map& get_x() const { return data.get_x(); }
+  const Map& get_y() const { return data.get_y(); }
+  const std::vector<double>& get_r_edges() const { return data.get_r_edges(); }
+
+  // Valid spaxels and their packed spectra
+  const std::vector<Spaxel>& get_valid() const { return data.get_valid(); }
+  const std::vector<int>& get_valid_index() const
+  { return data.get_valid_index(); }
+  const double* get_valid_data(int h) const { return data.get_valid_data(h); }
+  const uint32_t* get_valid_level(int h) const
+  { return data.get_valid_level(h); }
+  const std::vector<double>& get_var_levels() const
+  { return data.get_var_levels(); }
+  double get_valid_log_norm(int h) const
+  { return data.get_valid_log_norm(h); }
+
+  // PSF
+  int get_convolve() const { return data.get_convolve(); }
+  int get_gaussian_method() const { return data.get_gaussian_method(); }
+  const std::vector<double>& get_psf_amp() const { return psf_amp; }
+  const std::vector<double>& get_psf_fwhm() const { return psf_fwhm; }
+  double get_psf_beta() const { return data.get_psf_beta(); }
+  const std::vector<double>& get_psf_sigma() const { return psf_sigma; }
+  const std::vector<double>& get_psf_sigma_overdx() const
+  { return psf_sigma_overdx; }
+  const std::vector<double>& get_psf_sigma_overdy() const
+  { return psf_sigma_overdy; }
+
+  // Singleton, built from Data on first use after loading
+  static const ModelContext& get_instance();
+};
+
+#endif  // BLOBBY3D_MODELCONTEXT_H_
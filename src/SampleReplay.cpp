@@ -0,0 +1,61 @@
+#include "SampleReplay.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+
+#include "DiscModel.h"
+#include "ThreadPool.h"
+
+std::vector<std::string> SampleReplay::read_lines(const std::string& filepath) {
+  std::fstream fin(filepath, std::ios::in);
+  if (!fin) {
+    std::cerr<<"# ERROR: couldn't open file "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(fin, line))
+    if (!line.empty() && (line[0] != '#'))
+      lines.push_back(line);
+  fin.close();
+
+  return lines;
+}
+
+void SampleReplay::write(
+    const std::vector<std::string>& lines, const std::vector<int>& samples,
+    int nthreads, SampleWriter& writer) {
+  /*
+    Reconstruct batches of samples in parallel on the thread pool, then write
+    them in order. The model evaluations within a batch run serially on
+    their threads, as the pool is busy with the batch.
+  */
+  ThreadPool& pool = ThreadPool::get_instance();
+  pool.start(nthreads);
+
+  std::vector<DiscModel> models(nthreads);
+  std::vector<char> valid(nthreads);
+  for (size_t first=0; first<samples.size(); first+=nthreads) {
+    const int count = std::min<size_t>(nthreads, samples.size() - first);
+
+    pool.parallel_for(count, 1, [&](int begin, int end) {
+      for (int t=begin; t<end; t++) {
+        std::istringstream lin(lines[samples[first + t]]);
+        valid[t] = models[t].read(lin);
+      }
+    });
+
+    for (int t=0; t<count; t++) {
+      if (!valid[t]) {
+        std::cerr<<"# ERROR: sample "<<samples[first + t];
+        std::cerr<<" doesn't match the model options."<<std::endl;
+        exit(0);
+      }
+      models[t].write_products(writer);
+    }
+  }
+}
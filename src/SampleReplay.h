@@ -0,0 +1,34 @@
+#ifndef BLOBBY3D_SAMPLEREPLAY_H_
+#define BLOBBY3D_SAMPLEREPLAY_H_
+
+#include <string>
+#include <vector>
+
+#include "SampleWriter.h"
+
+/*
+  Reconstruction of sample products from saved parameters.
+
+  Each selected line of a DNest4 sample file is read by DiscModel::read,
+  which rebuilds the maps and cubes, and its products are written to a
+  SampleWriter as one record. Used by main to write the binary sample
+  products once sampling is done, and by the replay tool.
+*/
+class SampleReplay
+{
+ public:
+  // Read the sample lines of a DNest4 sample file, skipping comment lines
+  static std::vector<std::string> read_lines(const std::string& filepath);
+
+  /*
+    Write the products of lines[samples[n]] to writer for each n, in order.
+    Samples are reconstructed nthreads at a time on the thread pool, which
+    is started with at least nthreads threads. Exits if a line doesn't match
+    the model options.
+  */
+  static void write(
+    const std::vector<std::string>& lines, const std::vector<int>& samples,
+    int nthreads, SampleWriter& writer);
+};
+
+#endif  // BLOBBY3D_SAMPLEREPLAY_H_
@@ -0,0 +1,121 @@
+#include "SampleWriter.h"
+
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+
+const char magic[8] = {'B', '3', 'D', 'S', 'M', 'P', 'L', '\0'};
+
+void store_le(unsigned char* bytes, uint64_t value, int size) {
+  for (int b=0; b<size; b++) {
+    bytes[b] = static_cast<unsigned char>(value & 0xff);
+    value >>= 8;
+  }
+}
+
+void store_float64(unsigned char* bytes, double value) {
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  store_le(bytes, bits, 8);
+}
+
+void store_float32(unsigned char* bytes, float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  store_le(bytes, bits, 4);
+}
+
+}  // namespace
+
+SampleWriter SampleWriter::instance;
+
+SampleWriter::SampleWriter()
+  :value_size(8)
+  ,products(0)
+  ,record_values(0)
+  ,nvalues(0) {}
+
+void SampleWriter::open(
+    const std::string& filepath, int value_size, uint32_t products,
+    const ModelContext& context) {
+  this->filepath = filepath;
+  this->value_size = value_size;
+  this->products = products;
+  const int64_t nmaps = context.get_nlines() + 2;
+  const int64_t map_ni = context.get_ni();
+  const int64_t map_nj = context.get_nj();
+  const int64_t ni = context.get_ni() - 2*context.get_y_pad();
+  const int64_t nj = context.get_nj() - 2*context.get_x_pad();
+  const int64_t nr = context.get_nr();
+
+  record_values = 0;
+  if (products & save_maps)
+    record_values += nmaps*map_ni*map_nj;
+  if (products & save_preconvolved)
+    record_values += ni*nj*nr;
+  if (products & save_convolved)
+    record_values += ni*nj*nr;
+
+  unsigned char header[header_size];
+  std::memset(header, 0, header_size);
+  std::memcpy(header, magic, sizeof(magic));
+  store_le(header + 8, version, 4);
+  store_le(header + 12, value_size, 4);
+  store_le(header + 16, products, 4);
+  store_le(header + 20, nmaps, 4);
+  store_le(header + 24, map_ni, 8);
+  store_le(header + 32, map_nj, 8);
+  store_le(header + 40, ni, 8);
+  store_le(header + 48, nj, 8);
+  store_le(header + 56, nr, 8);
+  store_le(header + 64, record_values, 8);
+
+  fout.open(filepath, std::ios::out | std::ios::binary | std::ios::trunc);
+  fout.write(reinterpret_cast<const char*>(header), header_size);
+  fout.flush();
+  if (!fout) {
+    std::cerr<<"# ERROR: couldn't write file "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  buffer.assign(record_values*value_size, 0);
+  nvalues = 0;
+}
+
+void SampleWriter::write(
+    const double* values, size_t size, double offset, double scale) {
+  if (nvalues + size > record_values) {
+    std::cerr<<"# ERROR: sample record is larger than the layout of ";
+    std::cerr<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  unsigned char* out = buffer.data() + nvalues*value_size;
+  if (value_size == 8) {
+    for (size_t n=0; n<size; n++)
+      store_float64(out + 8*n, (values[n] + offset)*scale);
+  } else {
+    for (size_t n=0; n<size; n++)
+      store_float32(out + 4*n, static_cast<float>((values[n] + offset)*scale));
+  }
+  nvalues += size;
+}
+
+void SampleWriter::end_record() {
+  if (nvalues != record_values) {
+    std::cerr<<"# ERROR: sample record is smaller than the layout of ";
+    std::cerr<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+
+  // Flushed per record, so the file only ever holds whole records
+  fout.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+  fout.flush();
+  if (!fout) {
+    std::cerr<<"# ERROR: couldn't write file "<<filepath<<"."<<std::endl;
+    exit(0);
+  }
+  nvalues = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef BLOBBY3D_SAMPLEWRITER_H_
+#define BLOBBY3D_SAMPLEWRITER_H_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ModelContext.h"
+
+/*
+  Binary sample products.
+
+  When SAMPLE_FORMAT is FLOAT32 or FLOAT64, sample.txt only holds the
+  parameters and the maps and cubes of each saved sample are reconstructed
+  from them and written here once sampling is done. Record n belongs to
+  line n of sample.txt. The replay tool writes the same format for the
+  samples it reconstructs. The file has
+  a 128 byte little-endian header followed by fixed size records:
+
+    offset  type       field
+         0  char[8]    magic "B3DSMPL\0"
+         8  uint32     format version (1)
+        12  uint32     bytes per value (4 = float32, 8 = float64)
+        16  uint32     products saved (1 = maps, 2 = preconvolved,
+                       4 = convolved)
+        20  uint32     number of maps (flux per line, velocity, dispersion)
+        24  int64[2]   map shape, including padding
+        40  int64[3]   cube shape (ni, nj, nr), excluding padding
+        64  int64      values per record
+        72             reserved (zero)
+
+  Each record holds the selected products in the order maps, preconvolved
+  cube, convolved cube, with the same values and order as the text format.
+  Values are converted into a buffer and written once per record.
+
+  Singleton pattern
+*/
+class SampleWriter {
+ public:
+  static const int header_size = 128;
+  static const uint32_t version = 1;
+
+  // Products selected by the header flags
+  static const uint32_t save_maps = 1;
+  static const uint32_t save_preconvolved = 2;
+  static const uint32_t save_convolved = 4;
+
+ private:
+  std::ofstream fout;
+  std::string filepath;
+  int value_size;
+  uint32_t products;
+  size_t record_values;
+
+  // Current record, converted to little-endian values
+  std::vector<unsigned char> buffer;
+  size_t nvalues;
+
+  SampleWriter();
+  SampleWriter(const SampleWriter& other);
+
+  static SampleWriter instance;
+
+ public:
+  // Create the file and write its header, with the shapes of the context
+  void open(
+    const std::string& filepath, int value_size, uint32_t products,
+    const ModelContext& context);
+
+  bool is_open() const { return fout.is_open(); }
+
+  // Products saved in each record
+  uint32_t get_products() const { return products; }
+
+  // Append (values[n] + offset)*scale for n in [0, size) to the record
+  void write(
+    const double* values, size_t size, double offset=0.0, double scale=1.0);
+
+  // Write the record to the file, exits if it doesn't match the layout
+  void end_record();
+
+  // Getter
+  static SampleWriter& get_instance() { return instance; }
+};
+
+#endif  // BLOBBY3D_SAMPLEWRITER_H_
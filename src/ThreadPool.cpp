@@ -0,0 +1,93 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool ThreadPool::instance;
+
+ThreadPool::ThreadPool()
+    :task(nullptr)
+    ,task_size(0)
+    ,task_chunk(1)
+    ,next_chunk(0)
+    ,generation(0)
+    ,pending_workers(0)
+    ,stopping(false)
+    ,running(false) {
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  start_condition.notify_all();
+
+  for (size_t t=0; t<workers.size(); t++)
+    workers[t].join();
+}
+
+void ThreadPool::start(int nthreads) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (int t=workers.size() + 1; t<nthreads; t++)
+    workers.push_back(std::thread(&ThreadPool::worker_loop, this));
+}
+
+void ThreadPool::parallel_for(int n, int chunk, const Task& task) {
+  chunk = std::max(chunk, 1);
+
+  // Run serially when there is no one to share with
+  bool expected = false;
+  if (workers.empty() || (n <= chunk)
+      || !running.compare_exchange_strong(expected, true)) {
+    if (n > 0)
+      task(0, n);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->task = &task;
+    task_size = n;
+    task_chunk = chunk;
+    next_chunk = 0;
+    pending_workers = workers.size();
+    generation++;
+  }
+  start_condition.notify_all();
+
+  run_chunks();
+
+  // Wait until every worker has finished with the task
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_condition.wait(lock, [this]{ return pending_workers == 0; });
+    this->task = nullptr;
+  }
+
+  running = false;
+}
+
+void ThreadPool::run_chunks() {
+  int begin;
+  while ((begin = task_chunk*next_chunk++) < task_size)
+    (*task)(begin, std::min(begin + task_chunk, task_size));
+}
+
+void ThreadPool::worker_loop() {
+  unsigned int seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    start_condition.wait(
+      lock, [&]{ return stopping || (generation != seen); });
+    if (stopping)
+      return;
+    seen = generation;
+
+    lock.unlock();
+    run_chunks();
+    lock.lock();
+
+    if (--pending_workers == 0)
+      done_condition.notify_one();
+  }
+}
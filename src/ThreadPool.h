@@ -0,0 +1,69 @@
+#ifndef BLOBBY3D_THREADPOOL_H_
+#define BLOBBY3D_THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+  Persistent pool of worker threads used to split the work of evaluating a
+  single model, e.g. over spaxels or wavelength slices. Work is divided into
+  chunks that threads claim from a shared counter until none are left, so
+  faster threads take on more chunks.
+
+  Only one loop runs on the pool at a time. If the pool is busy, for example
+  because DNest4 threads are evaluating other particles, the loop is run
+  serially by the caller. So is a loop started by a task of another loop.
+
+  Singleton pattern
+*/
+class ThreadPool {
+ public:
+  // Function of a chunk of indices [begin, end)
+  typedef std::function<void(int begin, int end)> Task;
+
+ private:
+  std::vector<std::thread> workers;
+
+  std::mutex mutex;
+  std::condition_variable start_condition;
+  std::condition_variable done_condition;
+
+  // Current loop
+  const Task* task;
+  int task_size;
+  int task_chunk;
+  std::atomic<int> next_chunk;
+  unsigned int generation;
+  int pending_workers;
+  bool stopping;
+
+  // Set while a loop is running on the pool
+  std::atomic<bool> running;
+
+  ThreadPool();
+  ThreadPool(const ThreadPool& other);
+  ~ThreadPool();
+
+  void worker_loop();
+  void run_chunks();
+
+  static ThreadPool instance;
+
+ public:
+  // Start threads so that nthreads, including the caller, share each loop
+  void start(int nthreads);
+
+  // Number of threads sharing each loop, including the caller
+  int get_num_threads() const { return workers.size() + 1; }
+
+  // Run task over [0, n) in chunks of up to chunk indices
+  void parallel_for(int n, int chunk, const Task& task);
+
+  static ThreadPool& get_instance() { return instance; }
+};
+
+#endif  // BLOBBY3D_THREADPOOL_H_
@@ -3,8 +3,13 @@
 
 #include "DNest4/code/DNest4.h"
 
+#include "Conv.h"
 #include "Data.h"
 #include "DiscModel.h"
+#include "ModelContext.h"
+#include "SampleReplay.h"
+#include "SampleWriter.h"
+#include "ThreadPool.h"
 
 int main(int argc, char** argv) {
   // clock_t begin = clock();
@@ -31,10 +36,39 @@ int main(int argc, char** argv) {
   // Load data
   Data::get_instance().load(moptions_file);
 
+  // Threads shared by the evaluation of each model
+  ThreadPool::get_instance().start(Data::get_instance().get_model_threads());
+
+  // Set up the PSF operator under those threads and report its method
+  PsfOperator::get_instance()->summarise();
+
+  // Binary sample products are written once sampling is done
+  const ModelContext& context = ModelContext::get_instance();
+  if (context.get_sample_value_size() > 0)
+    SampleWriter::get_instance().open(
+      Data::get_instance().get_sample_products_file(),
+      context.get_sample_value_size(), context.get_save_products(), context);
+
   // Setup and run sampler
   DNest4::Sampler<DiscModel> sampler = DNest4::setup<DiscModel>(options);
   sampler.run();
 
+  /*
+    The binary sample products are reconstructed from the parameters in
+    sample.txt, which are saved at full precision, once sampling is done
+  */
+  if (context.get_sample_value_size() > 0) {
+    std::vector<std::string> lines = SampleReplay::read_lines("sample.txt");
+    std::vector<int> samples(lines.size());
+    for (size_t s=0; s<samples.size(); s++)
+      samples[s] = s;
+
+    std::cout<<"Writing the products of "<<samples.size()<<" samples..."
+      <<std::endl;
+    SampleReplay::write(
+      lines, samples, options.get_num_threads(), SampleWriter::get_instance());
+  }
+
   // clock_t end = clock();
   // double elapsed_secs = double(end - begin)/CLOCKS_PER_SEC;
   // std::cout<<"TIME: "<<elapsed_secs<<std::endl;
@@ -0,0 +1,178 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#include "Conv.h"
+#include "Data.h"
+#include "ModelContext.h"
+#include "SampleReplay.h"
+#include "SampleWriter.h"
+#include "ThreadPool.h"
+
+/*
+  Reconstruct the maps and cubes of saved samples from their parameters.
+
+  Usage:
+    Blobby3DReplay -f MODEL_OPTIONS [-i sample.txt] [-o replay.b3d]
+      [-t threads] [-s samples] [-p products]
+
+  Each line of the sample file is read by DiscModel::read, so samples saved
+  with SAMPLE_FORMAT PARAMETERS are reconstructed exactly. The products are
+  written in the binary sample format, one record per selected sample in the
+  order given. Samples are reconstructed in parallel, one per thread.
+
+  -s selects samples by line number from 0, as a comma separated list of
+  numbers or first-last ranges. All samples are replayed by default.
+  -p selects products as a comma separated list of maps, preconvolved and
+  convolved. It defaults to the SAVE_* options, or all products if the
+  samples hold parameters only.
+*/
+
+namespace {
+
+void usage_error(const std::string& message) {
+  std::cerr<<"# ERROR: "<<message<<std::endl;
+  std::cerr
+    <<"Usage: Blobby3DReplay -f MODEL_OPTIONS [-i sample.txt] "
+    <<"[-o replay.b3d] [-t threads] [-s samples] [-p products]"<<std::endl;
+  exit(0);
+}
+
+std::vector<std::string> split(const std::string& list) {
+  std::vector<std::string> items;
+  std::istringstream lin(list);
+  std::string item;
+  while (std::getline(lin, item, ','))
+    if (!item.empty())
+      items.push_back(item);
+  return items;
+}
+
+std::vector<int> parse_samples(const std::string& list) {
+  std::vector<int> samples;
+  std::vector<std::string> items = split(list);
+  for (size_t n=0; n<items.size(); n++) {
+    int first, last;
+    char dash;
+    std::istringstream lin(items[n]);
+    if (!(lin >> first))
+      usage_error("couldn't read sample selection " + list + ".");
+    last = first;
+    if (lin >> dash) {
+      if ((dash != '-') || !(lin >> last))
+        usage_error("couldn't read sample selection " + list + ".");
+    }
+    if ((first < 0) || (last < first))
+      usage_error("strange sample range " + items[n] + ".");
+    for (int s=first; s<=last; s++)
+      samples.push_back(s);
+  }
+  return samples;
+}
+
+uint32_t parse_products(const std::string& list) {
+  uint32_t products = 0;
+  std::vector<std::string> items = split(list);
+  for (size_t n=0; n<items.size(); n++) {
+    if (items[n] == "maps")
+      products |= SampleWriter::save_maps;
+    else if (items[n] == "preconvolved")
+      products |= SampleWriter::save_preconvolved;
+    else if (items[n] == "convolved")
+      products |= SampleWriter::save_convolved;
+    else
+      usage_error("couldn't determine product " + items[n] + ".");
+  }
+  return products;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string moptions_file;
+  std::string sample_file = "sample.txt";
+  std::string output_file = "replay.b3d";
+  std::string sample_list;
+  std::string product_list;
+  int nthreads = 1;
+
+  for (int a=1; a<argc; a++) {
+    std::string option = argv[a];
+    if (a + 1 == argc)
+      usage_error("no value given for option " + option + ".");
+    std::string value = argv[++a];
+
+    if (option == "-f")
+      moptions_file = value;
+    else if (option == "-i")
+      sample_file = value;
+    else if (option == "-o")
+      output_file = value;
+    else if (option == "-t")
+      nthreads = atoi(value.c_str());
+    else if (option == "-s")
+      sample_list = value;
+    else if (option == "-p")
+      product_list = value;
+    else
+      usage_error("couldn't determine option " + option + ".");
+  }
+
+  if (moptions_file.empty())
+    usage_error("No model options file provided.");
+  if (nthreads < 1)
+    usage_error("strange number of threads.");
+
+  // Load data
+  Data::get_instance().load(moptions_file.c_str());
+  ThreadPool::get_instance().start(Data::get_instance().get_model_threads());
+  PsfOperator::get_instance()->summarise();
+  const ModelContext& context = ModelContext::get_instance();
+
+  // Read the selected samples
+  std::vector<std::string> lines = SampleReplay::read_lines(sample_file);
+
+  std::vector<int> samples;
+  if (sample_list.empty()) {
+    for (size_t s=0; s<lines.size(); s++)
+      samples.push_back(s);
+  } else {
+    samples = parse_samples(sample_list);
+  }
+
+  for (size_t n=0; n<samples.size(); n++) {
+    if (samples[n] >= static_cast<int>(lines.size())) {
+      std::cerr<<"# ERROR: sample "<<samples[n]<<" not in "<<sample_file;
+      std::cerr<<", which has "<<lines.size()<<" samples."<<std::endl;
+      exit(0);
+    }
+  }
+
+  /*
+    Products default to those saved during sampling
+  */
+  uint32_t products = context.get_save_products();
+  if (!product_list.empty())
+    products = parse_products(product_list);
+  if (products == 0)
+    products = SampleWriter::save_maps | SampleWriter::save_preconvolved
+      | SampleWriter::save_convolved;
+
+  int value_size = context.get_sample_value_size();
+  if (value_size == 0)
+    value_size = 8;
+
+  SampleWriter& writer = SampleWriter::get_instance();
+  writer.open(output_file, value_size, products, context);
+
+  std::cout<<"Replaying "<<samples.size()<<" samples..."<<std::endl;
+
+  SampleReplay::write(lines, samples, nthreads, writer);
+
+  std::cout<<"Products saved to "<<output_file<<"."<<std::endl;
+
+  return 0;
+}